@@ -0,0 +1,454 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <utility>
+
+/**
+ * Example
+ *
+ * parallel::channel<int> requests(16);          // buffered
+ * parallel::channel<std::string> control;       // unbuffered, send waits for a receiver
+ *
+ * int request;
+ * std::string command;
+ * auto s = parallel::select(parallel::on_recv(requests, request),
+ *                           parallel::on_recv(control, command));
+ * if (!s.ok)            // that channel was closed and drained
+ *    ...
+ * else if (s.index == 0)
+ *    handle(request);
+ */
+
+namespace parallel {
+
+// Which case of a select completed; ok is false if its channel was closed.
+struct selected
+{
+   std::size_t index;
+   bool ok;
+};
+
+namespace detail {
+
+// One blocked select (a blocking send or recv is a select of one case). Every channel
+// of the select queues the same waiter; the first one to claim it completes its case.
+struct select_waiter
+{
+   static constexpr std::size_t none = std::numeric_limits<std::size_t>::max();
+
+   std::atomic<std::size_t> fired {none};
+   std::mutex mut;
+   std::condition_variable cond;
+   bool done {false};
+   bool ok {false};
+
+   bool try_claim(std::size_t index) noexcept
+   {
+      auto expected = none;
+      return fired.compare_exchange_strong(expected, index, std::memory_order_acq_rel);
+   }
+
+   // called by the claiming channel under its lock, after the transfer
+   void complete(bool result)
+   {
+      std::lock_guard<std::mutex> lk(mut);
+      ok = result;
+      done = true;
+      cond.notify_one();
+   }
+
+   void wait()
+   {
+      std::unique_lock<std::mutex> lk(mut);
+      cond.wait(lk, [this]{ return done; });
+   }
+};
+
+class select_case
+{
+public:
+   virtual ~select_case() = default;
+
+   virtual std::mutex& channel_mutex() noexcept = 0;
+   // The rest is called with the channel locked.
+   // Completes the case if it can go ahead right now.
+   virtual bool try_complete(bool& ok) = 0;
+   virtual void enqueue(select_waiter& w, std::size_t index) = 0;
+   virtual void dequeue(select_waiter& w) = 0;
+};
+
+template <typename T> class recv_case;
+template <typename T> class send_case;
+
+}
+
+/**
+ * @brief The channel class
+ * Go-style typed channel. With capacity 0 a send waits until a receiver takes the value,
+ * otherwise up to capacity values are buffered. After close() sends fail, receivers drain
+ * what is buffered and then fail; blocked senders and receivers wake up.
+ * Blocked parties sleep on a condition variable, select() waits on any number of
+ * channels with one waiter queued on each.
+ */
+template <typename T>
+class channel
+{
+   friend class detail::recv_case<T>;
+   friend class detail::send_case<T>;
+
+   struct recv_entry
+   {
+      detail::select_waiter* w;
+      std::size_t index;
+      T* slot;
+   };
+
+   struct send_entry
+   {
+      detail::select_waiter* w;
+      std::size_t index;
+      T* value;
+   };
+
+   mutable std::mutex _mut;
+   std::size_t const _capacity;
+   std::deque<T> _buf;
+   std::deque<recv_entry> _receivers;
+   std::deque<send_entry> _senders;
+   bool _closed {false};
+
+   // The functions below are called under _mut. Queued waiters may have been completed
+   // by another channel of their select in the meantime, those entries are dropped.
+
+   // hands the value of the first live sender to take
+   template <typename F>
+   bool take_from_sender(F take)
+   {
+      while (!_senders.empty())
+      {
+         auto e = _senders.front();
+         _senders.pop_front();
+         if (e.w->try_claim(e.index))
+         {
+            take(*e.value);
+            e.w->complete(true);
+            return true;
+         }
+      }
+      return false;
+   }
+
+   bool recv_locked(T& out, bool& ok)
+   {
+      if (!_buf.empty())
+      {
+         out = std::move(_buf.front());
+         _buf.pop_front();
+
+         // a full buffer has room again
+         take_from_sender([this](T& value){ _buf.push_back(std::move(value)); });
+         ok = true;
+         return true;
+      }
+
+      if (take_from_sender([&out](T& value){ out = std::move(value); }))
+      {
+         ok = true;
+         return true;
+      }
+
+      ok = false;
+      return _closed;
+   }
+
+   bool send_locked(T& value, bool& ok)
+   {
+      ok = false;
+      if (_closed)
+         return true;
+
+      while (!_receivers.empty())
+      {
+         auto e = _receivers.front();
+         _receivers.pop_front();
+         if (e.w->try_claim(e.index))
+         {
+            *e.slot = std::move(value);
+            e.w->complete(true);
+            ok = true;
+            return true;
+         }
+      }
+
+      if (_buf.size() < _capacity)
+      {
+         _buf.push_back(std::move(value));
+         ok = true;
+         return true;
+      }
+      return false;
+   }
+
+public:
+   explicit channel(std::size_t capacity = 0) : _capacity(capacity)
+   {   }
+
+   channel(channel const&) = delete;
+   channel& operator=(channel const&) = delete;
+
+   // Blocks until the value is buffered or received; false if the channel is closed.
+   bool send(T value);
+
+   // Blocks until a value arrives; false once the channel is closed and drained.
+   bool recv(T& value);
+
+   // Moves from value only on success.
+   bool try_send(T&& value)
+   {
+      std::lock_guard<std::mutex> lk(_mut);
+      bool ok;
+      return send_locked(value, ok) && ok;
+   }
+
+   bool try_recv(T& value)
+   {
+      std::lock_guard<std::mutex> lk(_mut);
+      bool ok;
+      return recv_locked(value, ok) && ok;
+   }
+
+   void close()
+   {
+      std::lock_guard<std::mutex> lk(_mut);
+      _closed = true;
+      for (auto& e : _receivers)
+         if (e.w->try_claim(e.index))
+            e.w->complete(false);
+      for (auto& e : _senders)
+         if (e.w->try_claim(e.index))
+            e.w->complete(false);
+      _receivers.clear();
+      _senders.clear();
+   }
+
+   bool closed() const
+   {
+      std::lock_guard<std::mutex> lk(_mut);
+      return _closed;
+   }
+
+   // buffered values
+   std::size_t size() const
+   {
+      std::lock_guard<std::mutex> lk(_mut);
+      return _buf.size();
+   }
+};
+
+namespace detail {
+
+template <typename T>
+class recv_case : public select_case
+{
+   channel<T>& _ch;
+   T& _value;
+
+public:
+   recv_case(channel<T>& ch, T& value) : _ch(ch), _value(value)
+   {   }
+
+   std::mutex& channel_mutex() noexcept override { return _ch._mut; }
+
+   bool try_complete(bool& ok) override
+   {
+      return _ch.recv_locked(_value, ok);
+   }
+
+   void enqueue(select_waiter& w, std::size_t index) override
+   {
+      _ch._receivers.push_back({&w, index, &_value});
+   }
+
+   void dequeue(select_waiter& w) override
+   {
+      auto& q = _ch._receivers;
+      q.erase(std::remove_if(q.begin(), q.end(), [&w](auto const& e){ return e.w == &w; }), q.end());
+   }
+};
+
+template <typename T>
+class send_case : public select_case
+{
+   channel<T>& _ch;
+   T _value;
+
+public:
+   send_case(channel<T>& ch, T value) : _ch(ch), _value(std::move(value))
+   {   }
+
+   std::mutex& channel_mutex() noexcept override { return _ch._mut; }
+
+   bool try_complete(bool& ok) override
+   {
+      return _ch.send_locked(_value, ok);
+   }
+
+   void enqueue(select_waiter& w, std::size_t index) override
+   {
+      _ch._senders.push_back({&w, index, &_value});
+   }
+
+   void dequeue(select_waiter& w) override
+   {
+      auto& q = _ch._senders;
+      q.erase(std::remove_if(q.begin(), q.end(), [&w](auto const& e){ return e.w == &w; }), q.end());
+   }
+};
+
+// Locks the distinct channels of a select in address order, like make_locks(ordered, ...).
+class select_locks
+{
+   std::mutex** _first;
+   std::mutex** _last;
+
+public:
+   select_locks(select_case* const* cases, std::mutex** mutexes, std::size_t count)
+   : _first(mutexes)
+   {
+      for (std::size_t i = 0; i < count; ++i)
+         mutexes[i] = &cases[i]->channel_mutex();
+      std::sort(mutexes, mutexes + count);
+      _last = std::unique(mutexes, mutexes + count);
+      lock();
+   }
+
+   ~select_locks()
+   {
+      unlock();
+   }
+
+   void lock()
+   {
+      for (auto m = _first; m != _last; ++m)
+         (*m)->lock();
+   }
+
+   void unlock()
+   {
+      for (auto m = _last; m != _first; --m)
+         (*(m - 1))->unlock();
+   }
+};
+
+// With all channels locked: take the first ready case, starting at a rotating
+// position so a busy channel does not starve the ones after it. Otherwise queue one
+// waiter on every channel, sleep until a channel completes it and dequeue it again.
+inline selected run_select(select_case* const* cases, std::mutex** mutexes, std::size_t count, bool block)
+{
+   static thread_local std::size_t rotation = 0;
+
+   select_locks locks(cases, mutexes, count);
+   auto const start = rotation++ % count;
+   for (std::size_t i = 0; i < count; ++i)
+   {
+      auto index = (start + i) % count;
+      bool ok;
+      if (cases[index]->try_complete(ok))
+         return {index, ok};
+   }
+
+   if (!block)
+      return {count, false};
+
+   select_waiter w;
+   for (std::size_t i = 0; i < count; ++i)
+      cases[i]->enqueue(w, i);
+
+   locks.unlock();
+   w.wait();
+   locks.lock();
+
+   for (std::size_t i = 0; i < count; ++i)
+      cases[i]->dequeue(w);
+   return {w.fired.load(std::memory_order_relaxed), w.ok};
+}
+
+}
+
+template <typename T>
+detail::recv_case<T> on_recv(channel<T>& ch, T& value)
+{
+   return {ch, value};
+}
+
+template <typename T, typename U>
+detail::send_case<T> on_send(channel<T>& ch, U&& value)
+{
+   return {ch, T(std::forward<U>(value))};
+}
+
+// Blocks until one of the cases completes and returns its index (in argument order).
+template <typename... Cases>
+selected select(Cases&&... cases)
+{
+   static_assert(sizeof...(Cases) > 0, "select: needs at least one case");
+   std::array<detail::select_case*, sizeof...(Cases)> all {{&cases...}};
+   std::array<std::mutex*, sizeof...(Cases)> mutexes;
+   return detail::run_select(all.data(), mutexes.data(), all.size(), true);
+}
+
+// Like select, but returns index == number of cases if none is ready.
+template <typename... Cases>
+selected try_select(Cases&&... cases)
+{
+   static_assert(sizeof...(Cases) > 0, "try_select: needs at least one case");
+   std::array<detail::select_case*, sizeof...(Cases)> all {{&cases...}};
+   std::array<std::mutex*, sizeof...(Cases)> mutexes;
+   return detail::run_select(all.data(), mutexes.data(), all.size(), false);
+}
+
+template <typename T>
+bool channel<T>::send(T value)
+{
+   return select(detail::send_case<T>(*this, std::move(value))).ok;
+}
+
+template <typename T>
+bool channel<T>::recv(T& value)
+{
+   return select(detail::recv_case<T>(*this, value)).ok;
+}
+
+}
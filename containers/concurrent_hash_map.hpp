@@ -0,0 +1,433 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "sync/spin_lock.hpp"
+
+/**
+ * Example
+ *
+ * parallel::concurrent_hash_map<std::uint64_t, order_state> orders;
+ * orders.insert(id, state);
+ * order_state s;
+ * if (orders.find(id, s))                                  // lock-free
+ *    ...
+ * orders.update(id, [](order_state& s){ s.filled += qty; });
+ */
+
+namespace parallel {
+
+/**
+ * @brief The concurrent_hash_map class
+ * Open addressing hash map split into independent segments chosen by the key's hash.
+ * Each segment is a linear probing table with its own writer lock and sequence counter:
+ * writers lock only their segment, find() copies the slot optimistically without
+ * writing shared memory and retries if a writer overlapped (falling back to the lock
+ * after a few attempts). A segment grows on its own, so a resize holds up the writers
+ * of one segment while readers keep reading the old table; old tables are retired
+ * until destruction (less memory than the live tables in total).
+ * Key and T are kept in relaxed atomic words like seqlock, so both must be trivially
+ * copyable; KeyEqual may be called on a torn copy of a key, the result is discarded.
+ */
+template <typename Key, typename T, typename Hash = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key>, typename Lock = std::mutex>
+class concurrent_hash_map
+{
+   static_assert(std::is_trivially_copyable<Key>::value, "concurrent_hash_map: Key must be trivially copyable");
+   static_assert(std::is_trivially_copyable<T>::value, "concurrent_hash_map: T must be trivially copyable");
+
+   using word = std::uintptr_t;
+
+   static constexpr std::size_t words_of(std::size_t size)
+   {
+      return (size + sizeof(word) - 1) / sizeof(word);
+   }
+
+   static constexpr std::size_t key_words = words_of(sizeof(Key));
+   static constexpr std::size_t value_words = words_of(sizeof(T));
+   static constexpr unsigned optimistic_attempts = 8;
+
+   struct slot_state
+   {
+      static constexpr word empty = 0;
+      static constexpr word full = 1;
+      static constexpr word erased = 2;
+   };
+
+   struct slot
+   {
+      std::atomic<word> state {slot_state::empty};
+      std::atomic<word> key[key_words] {};
+      std::atomic<word> value[value_words] {};
+   };
+
+   struct table
+   {
+      std::size_t mask;
+      std::unique_ptr<slot[]> slots;
+
+      explicit table(std::size_t capacity)
+      : mask(capacity - 1), slots(new slot[capacity])
+      {   }
+
+      std::size_t capacity() const noexcept { return mask + 1; }
+   };
+
+   struct segment
+   {
+      Lock mut;
+      std::atomic<unsigned> seq {0};
+      std::atomic<table*> current {nullptr};
+      std::atomic<std::size_t> count {0};
+      std::size_t used {0};                        // full and erased slots, under mut
+      std::vector<std::unique_ptr<table>> tables;   // under mut, the current one is last
+      char _pad[64];
+   };
+
+   // writer side of the segment's sequence counter
+   class write_section
+   {
+      segment& _s;
+      unsigned _seq;
+
+   public:
+      explicit write_section(segment& s) noexcept
+      : _s(s), _seq(s.seq.load(std::memory_order_relaxed))
+      {
+         _s.seq.store(_seq + 1, std::memory_order_relaxed);
+         std::atomic_thread_fence(std::memory_order_release);
+      }
+
+      ~write_section()
+      {
+         _s.seq.store(_seq + 2, std::memory_order_release);
+      }
+   };
+
+   Hash _hash;
+   KeyEqual _equal;
+   std::size_t _segments_mask;
+   std::unique_ptr<segment[]> _segments;
+
+   template <typename U>
+   static void store_words(std::atomic<word>* dst, U const& value) noexcept
+   {
+      word buffer[words_of(sizeof(U))] = {};
+      std::memcpy(buffer, &value, sizeof(U));
+      for (std::size_t i = 0; i < words_of(sizeof(U)); ++i)
+         dst[i].store(buffer[i], std::memory_order_relaxed);
+   }
+
+   template <typename U>
+   static U load_words(std::atomic<word> const* src) noexcept
+   {
+      word buffer[words_of(sizeof(U))];
+      for (std::size_t i = 0; i < words_of(sizeof(U)); ++i)
+         buffer[i] = src[i].load(std::memory_order_relaxed);
+
+      typename std::aligned_storage<sizeof(U), alignof(U)>::type value;
+      std::memcpy(&value, buffer, sizeof(U));
+      return *reinterpret_cast<U*>(&value);
+   }
+
+   std::size_t hash(Key const& key) const
+   {
+      // std::hash of integers is the identity, spread it before linear probing
+      std::uint64_t h = _hash(key);
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdull;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ull;
+      h ^= h >> 33;
+      return static_cast<std::size_t>(h);
+   }
+
+   segment& segment_for(std::size_t h) const noexcept
+   {
+      return _segments[(h >> 32) & _segments_mask];
+   }
+
+   // Index of key's slot, or of the slot a new key goes to. Racing readers pass
+   // a bounded probe and may get any answer, the caller validates it.
+   std::size_t locate(table const& t, std::size_t h, Key const& key, bool& found) const
+   {
+      auto insert_at = t.capacity();
+      for (std::size_t i = 0; i <= t.mask; ++i)
+      {
+         auto index = (h + i) & t.mask;
+         auto& s = t.slots[index];
+         auto st = s.state.load(std::memory_order_relaxed);
+         if (st == slot_state::empty)
+         {
+            found = false;
+            return insert_at != t.capacity() ? insert_at : index;
+         }
+
+         if (st == slot_state::erased)
+         {
+            if (insert_at == t.capacity())
+               insert_at = index;
+         }
+         else if (_equal(load_words<Key>(s.key), key))
+         {
+            found = true;
+            return index;
+         }
+      }
+
+      found = false;
+      return insert_at;
+   }
+
+   static void put(table& t, std::size_t index, Key const& key, T const& value) noexcept
+   {
+      auto& s = t.slots[index];
+      store_words(s.key, key);
+      store_words(s.value, value);
+      s.state.store(slot_state::full, std::memory_order_relaxed);
+   }
+
+   // Makes room for one more key, under the segment's lock. Doubling builds a new table
+   // next to the live one; purging erased slots at the same size is done in place.
+   void reserve_one(segment& seg)
+   {
+      auto& t = *seg.current.load(std::memory_order_relaxed);
+      if ((seg.used + 1) * 4 <= t.capacity() * 3)
+         return;
+
+      auto count = seg.count.load(std::memory_order_relaxed);
+      bool grow = (count + 1) * 2 > t.capacity();
+
+      std::vector<std::pair<Key, T>> entries;
+      entries.reserve(count);
+      for (std::size_t i = 0; i <= t.mask; ++i)
+         if (t.slots[i].state.load(std::memory_order_relaxed) == slot_state::full)
+            entries.emplace_back(load_words<Key>(t.slots[i].key), load_words<T>(t.slots[i].value));
+
+      auto rehash = [this](table& target, std::vector<std::pair<Key, T>> const& entries)
+      {
+         for (auto& entry : entries)
+         {
+            bool found;
+            put(target, locate(target, hash(entry.first), entry.first, found), entry.first, entry.second);
+         }
+      };
+
+      if (grow)
+      {
+         auto bigger = std::make_unique<table>(t.capacity() * 2);
+         rehash(*bigger, entries);
+         seg.tables.push_back(std::move(bigger));
+         seg.current.store(seg.tables.back().get(), std::memory_order_release);
+      }
+      else
+      {
+         write_section ws(seg);
+         for (std::size_t i = 0; i <= t.mask; ++i)
+            t.slots[i].state.store(slot_state::empty, std::memory_order_relaxed);
+         rehash(t, entries);
+      }
+      seg.used = count;
+   }
+
+   template <typename F>
+   bool upsert(Key const& key, T const& value, F on_found)
+   {
+      auto h = hash(key);
+      auto& seg = segment_for(h);
+      std::lock_guard<Lock> lk(seg.mut);
+
+      reserve_one(seg);
+      auto& t = *seg.current.load(std::memory_order_relaxed);
+      bool found;
+      auto index = locate(t, h, key, found);
+      if (found)
+      {
+         on_found(seg, t.slots[index]);
+         return false;
+      }
+
+      write_section ws(seg);
+      if (t.slots[index].state.load(std::memory_order_relaxed) == slot_state::empty)
+         ++seg.used;
+      put(t, index, key, value);
+      seg.count.fetch_add(1, std::memory_order_relaxed);
+      return true;
+   }
+
+   bool lookup(Key const& key, T* value) const
+   {
+      auto h = hash(key);
+      auto& seg = segment_for(h);
+
+      detail::backoff b;
+      for (unsigned attempt = 0; attempt < optimistic_attempts; ++attempt)
+      {
+         auto before = seg.seq.load(std::memory_order_acquire);
+         if ((before & 1) == 0)
+         {
+            auto& t = *seg.current.load(std::memory_order_acquire);
+            bool found;
+            auto index = locate(t, h, key, found);
+            word copy[value_words];
+            if (found && value)
+               for (std::size_t i = 0; i < value_words; ++i)
+                  copy[i] = t.slots[index].value[i].load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seg.seq.load(std::memory_order_relaxed) == before)
+            {
+               if (found && value)
+                  std::memcpy(value, copy, sizeof(T));
+               return found;
+            }
+         }
+         b.pause();
+      }
+
+      // writers keep overlapping, queue up behind them
+      std::lock_guard<Lock> lk(seg.mut);
+      auto& t = *seg.current.load(std::memory_order_relaxed);
+      bool found;
+      auto index = locate(t, h, key, found);
+      if (found && value)
+         *value = load_words<T>(t.slots[index].value);
+      return found;
+   }
+
+public:
+   // capacity is spread over the segments, which are rounded up to powers of two
+   explicit concurrent_hash_map(std::size_t capacity = 1024, std::size_t segments = 64)
+   {
+      std::size_t segments_count = 1;
+      while (segments_count < segments)
+         segments_count <<= 1;
+
+      std::size_t per_segment = 8;
+      while (per_segment * 3 < capacity * 4 / segments_count)
+         per_segment <<= 1;
+
+      _segments_mask = segments_count - 1;
+      _segments.reset(new segment[segments_count]);
+      for (std::size_t i = 0; i < segments_count; ++i)
+      {
+         auto& seg = _segments[i];
+         seg.tables.push_back(std::make_unique<table>(per_segment));
+         seg.current.store(seg.tables.back().get(), std::memory_order_relaxed);
+      }
+   }
+
+   concurrent_hash_map(concurrent_hash_map const&) = delete;
+   concurrent_hash_map& operator=(concurrent_hash_map const&) = delete;
+
+   // Returns false and leaves the map unchanged if key is present.
+   bool insert(Key const& key, T const& value)
+   {
+      return upsert(key, value, [](segment&, slot&){});
+   }
+
+   // Returns true if key was inserted, false if its value was replaced.
+   bool insert_or_assign(Key const& key, T const& value)
+   {
+      return upsert(key, value, [&value](segment& seg, slot& s){
+         write_section ws(seg);
+         store_words(s.value, value);
+      });
+   }
+
+   // Calls f(T&) on key's value under the segment's lock and publishes the result.
+   template <typename F>
+   bool update(Key const& key, F&& f)
+   {
+      auto h = hash(key);
+      auto& seg = segment_for(h);
+      std::lock_guard<Lock> lk(seg.mut);
+
+      auto& t = *seg.current.load(std::memory_order_relaxed);
+      bool found;
+      auto index = locate(t, h, key, found);
+      if (!found)
+         return false;
+
+      auto& s = t.slots[index];
+      auto value = load_words<T>(s.value);
+      std::forward<F>(f)(value);
+
+      write_section ws(seg);
+      store_words(s.value, value);
+      return true;
+   }
+
+   bool erase(Key const& key)
+   {
+      auto h = hash(key);
+      auto& seg = segment_for(h);
+      std::lock_guard<Lock> lk(seg.mut);
+
+      auto& t = *seg.current.load(std::memory_order_relaxed);
+      bool found;
+      auto index = locate(t, h, key, found);
+      if (!found)
+         return false;
+
+      write_section ws(seg);
+      t.slots[index].state.store(slot_state::erased, std::memory_order_relaxed);
+      seg.count.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+   }
+
+   bool find(Key const& key, T& value) const
+   {
+      return lookup(key, &value);
+   }
+
+   bool contains(Key const& key) const
+   {
+      return lookup(key, nullptr);
+   }
+
+   // a snapshot while writers are running
+   std::size_t size() const noexcept
+   {
+      std::size_t total = 0;
+      for (std::size_t i = 0; i <= _segments_mask; ++i)
+         total += _segments[i].count.load(std::memory_order_relaxed);
+      return total;
+   }
+
+   bool empty() const noexcept { return size() == 0; }
+};
+
+}
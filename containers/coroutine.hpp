@@ -0,0 +1,371 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#if !defined(__cpp_impl_coroutine)
+#error "containers/coroutine.hpp requires C++20 coroutines (qmake CONFIG+=coroutines)"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "queue.hpp"
+#include "thread_pool.hpp"
+
+/**
+ * Example
+ *
+ * parallel::task<int> handle(parallel::thread_pool& pool, parallel::queue<int>& requests)
+ * {
+ *    co_await pool.schedule();                             // continue on a worker
+ *    int request = co_await parallel::async_pop(requests); // suspend until pushed
+ *    co_return co_await parallel::async(pool, [request]{ return request * 2; });
+ * }
+ *
+ * int r = parallel::sync_wait(handle(pool, requests));
+ */
+
+namespace parallel {
+
+template <typename T = void> class task;
+
+namespace detail {
+
+template <typename T>
+class result_holder
+{
+   std::optional<T> _value;
+   std::exception_ptr _error;
+
+public:
+   template <typename F>
+   void emplace_from(F& f)
+   {
+      try
+      {
+         _value.emplace(f());
+      }
+      catch (...)
+      {
+         _error = std::current_exception();
+      }
+   }
+
+   template <typename U>
+   void set_value(U&& value) { _value.emplace(std::forward<U>(value)); }
+   void set_error(std::exception_ptr error) noexcept { _error = error; }
+
+   T get()
+   {
+      if (_error)
+         std::rethrow_exception(_error);
+      return std::move(*_value);
+   }
+};
+
+template <>
+class result_holder<void>
+{
+   std::exception_ptr _error;
+
+public:
+   template <typename F>
+   void emplace_from(F& f)
+   {
+      try
+      {
+         f();
+      }
+      catch (...)
+      {
+         _error = std::current_exception();
+      }
+   }
+
+   void set_error(std::exception_ptr error) noexcept { _error = error; }
+
+   void get()
+   {
+      if (_error)
+         std::rethrow_exception(_error);
+   }
+};
+
+template <typename T>
+struct task_promise_base
+{
+   std::coroutine_handle<> _continuation;
+   result_holder<T> _result;
+
+   struct final_awaiter
+   {
+      bool await_ready() const noexcept { return false; }
+
+      template <typename P>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+      {
+         auto continuation = h.promise()._continuation;
+         return continuation ? continuation : std::noop_coroutine();
+      }
+
+      void await_resume() const noexcept {}
+   };
+
+   std::suspend_always initial_suspend() const noexcept { return {}; }
+   final_awaiter final_suspend() const noexcept { return {}; }
+   void unhandled_exception() noexcept { _result.set_error(std::current_exception()); }
+};
+
+template <typename T>
+struct task_promise : task_promise_base<T>
+{
+   task<T> get_return_object() noexcept;
+
+   template <typename U, typename = std::enable_if_t<std::is_convertible<U, T>::value>>
+   void return_value(U&& value) { this->_result.set_value(std::forward<U>(value)); }
+};
+
+template <>
+struct task_promise<void> : task_promise_base<void>
+{
+   task<void> get_return_object() noexcept;
+
+   void return_void() const noexcept {}
+};
+
+struct detached
+{
+   struct promise_type
+   {
+      detached get_return_object() const noexcept { return {}; }
+      std::suspend_never initial_suspend() const noexcept { return {}; }
+      std::suspend_never final_suspend() const noexcept { return {}; }
+      void return_void() const noexcept {}
+      void unhandled_exception() const noexcept { std::terminate(); }
+   };
+};
+
+}
+
+/**
+ * @brief The task class
+ * Lazily started coroutine: the body runs when the task is awaited, and the awaiting
+ * coroutine is resumed by symmetric transfer on whatever thread the task completes.
+ */
+template <typename T>
+class task
+{
+public:
+   using promise_type = detail::task_promise<T>;
+
+private:
+   std::coroutine_handle<promise_type> _h;
+
+public:
+   explicit task(std::coroutine_handle<promise_type> h) noexcept : _h(h)
+   {   }
+
+   task(task&& other) noexcept : _h(std::exchange(other._h, nullptr))
+   {   }
+
+   task& operator=(task&& other) noexcept
+   {
+      if (this != &other)
+      {
+         if (_h)
+            _h.destroy();
+         _h = std::exchange(other._h, nullptr);
+      }
+      return *this;
+   }
+
+   task(task const&) = delete;
+   task& operator=(task const&) = delete;
+
+   ~task()
+   {
+      if (_h)
+         _h.destroy();
+   }
+
+   bool await_ready() const noexcept
+   {
+      return !_h || _h.done();
+   }
+
+   std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+   {
+      _h.promise()._continuation = continuation;
+      return _h;
+   }
+
+   T await_resume()
+   {
+      return _h.promise()._result.get();
+   }
+};
+
+namespace detail {
+
+template <typename T>
+task<T> task_promise<T>::get_return_object() noexcept
+{
+   return task<T>(std::coroutine_handle<task_promise>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept
+{
+   return task<void>(std::coroutine_handle<task_promise>::from_promise(*this));
+}
+
+template <typename T>
+detached drive(task<T> t, std::promise<T> done)
+{
+   try
+   {
+      if constexpr (std::is_void<T>::value)
+      {
+         co_await t;
+         done.set_value();
+      }
+      else
+         done.set_value(co_await t);
+   }
+   catch (...)
+   {
+      done.set_exception(std::current_exception());
+   }
+}
+
+inline detached drive_detached(task<void> t)
+{
+   co_await t;
+}
+
+}
+
+// Runs the task and blocks the calling thread until it completes.
+template <typename T>
+T sync_wait(task<T> t)
+{
+   std::promise<T> done;
+   auto result = done.get_future();
+   detail::drive(std::move(t), std::move(done));
+   return result.get();
+}
+
+// Starts the task without waiting for it; an escaping exception terminates.
+inline void spawn(task<void> t)
+{
+   detail::drive_detached(std::move(t));
+}
+
+template <typename F, typename R = std::invoke_result_t<F&>>
+class async_awaiter
+{
+   thread_pool& _pool;
+   F _f;
+   detail::result_holder<R> _result;
+   priority _prio;
+
+public:
+   async_awaiter(thread_pool& pool, F f, priority p)
+   : _pool(pool), _f(std::move(f)), _prio(p)
+   {   }
+
+   bool await_ready() const noexcept { return false; }
+
+   void await_suspend(std::coroutine_handle<> h)
+   {
+      _pool.submit([this, h]{
+         _result.emplace_from(_f);
+         h.resume();
+      }, _prio);
+   }
+
+   R await_resume()
+   {
+      return _result.get();
+   }
+};
+
+// co_await parallel::async(pool, f); runs f on a worker and resumes there with its result
+template <typename F>
+async_awaiter<std::decay_t<F>> async(thread_pool& pool, F&& f, priority p = priority::normal)
+{
+   return {pool, std::forward<F>(f), p};
+}
+
+template <typename T, typename Lock, typename Allocator>
+class pop_awaiter
+{
+   queue<T, Lock, Allocator>& _q;
+   T _value {};
+   bool _closed {false};
+
+public:
+   explicit pop_awaiter(queue<T, Lock, Allocator>& q) noexcept : _q(q)
+   {   }
+
+   bool await_ready() const noexcept { return false; }
+
+   bool await_suspend(std::coroutine_handle<> h)
+   {
+      auto status = _q.pop_or_defer(_value, [this, h](T* value){
+         if (value)
+            _value = std::move(*value);
+         else
+            _closed = true;
+         h.resume();
+      });
+      // When deferred the waiter may already have resumed h, so *this is off limits
+      if (status == pop_status::deferred)
+         return true;
+
+      _closed = status == pop_status::closed;
+      return false;
+   }
+
+   T await_resume()
+   {
+      if (_closed)
+         throw queue_closed();
+      return std::move(_value);
+   }
+};
+
+// co_await parallel::async_pop(q); suspends until an element is pushed, the coroutine
+// then continues on the pushing thread. Throws queue_closed once q is closed and drained.
+template <typename T, typename Lock, typename Allocator>
+pop_awaiter<T, Lock, Allocator> async_pop(queue<T, Lock, Allocator>& q) noexcept
+{
+   return pop_awaiter<T, Lock, Allocator>(q);
+}
+
+}
@@ -0,0 +1,327 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "sync/spin_lock.hpp"
+
+/**
+ * Example
+ *
+ * parallel::disruptor<event> ring(1024);
+ * auto& journal = ring.add_consumer();
+ * auto& replicate = ring.add_consumer();
+ * auto& logic = ring.add_consumer({&journal, &replicate});   // sees an event after both
+ *
+ * raii::join_thread j([&]{ while (journal.process([](event const& e, std::int64_t, bool){ write(e); })) ; });
+ * ...
+ * ring.publish_event([&](event& e){ e = next(); });   // one producer thread
+ * ...
+ * ring.halt();   // process() returns 0 once everything published is processed
+ */
+
+namespace parallel {
+
+/**
+ * Wait strategies: wait_for(sequence, available, halted) returns once available() >= sequence
+ * or halted() and then returns available(); signal() is called after every sequence move.
+ * busy_spin_wait is the lowest latency but burns its core, yielding_wait gives the core
+ * to other threads, blocking_wait sleeps on a condition variable after a short spin.
+ */
+struct busy_spin_wait
+{
+   template <typename Available, typename Halted>
+   std::int64_t wait_for(std::int64_t sequence, Available available, Halted halted)
+   {
+      std::int64_t current;
+      while ((current = available()) < sequence && !halted())
+         detail::cpu_relax();
+      return current;
+   }
+
+   void signal() noexcept
+   {   }
+};
+
+struct yielding_wait
+{
+   template <typename Available, typename Halted>
+   std::int64_t wait_for(std::int64_t sequence, Available available, Halted halted)
+   {
+      std::int64_t current;
+      for (unsigned spins = 0; (current = available()) < sequence && !halted(); ++spins)
+      {
+         if (spins < 64)
+            detail::cpu_relax();
+         else
+            std::this_thread::yield();
+      }
+      return current;
+   }
+
+   void signal() noexcept
+   {   }
+};
+
+class blocking_wait
+{
+   std::mutex _mut;
+   std::condition_variable _cond;
+   std::atomic<int> _sleepers {0};
+
+public:
+   template <typename Available, typename Halted>
+   std::int64_t wait_for(std::int64_t sequence, Available available, Halted halted)
+   {
+      std::int64_t current;
+      for (int i = 0; i < 128; ++i)
+      {
+         if ((current = available()) >= sequence || halted())
+            return current;
+         detail::cpu_relax();
+      }
+
+      std::unique_lock<std::mutex> lk(_mut);
+      _sleepers.fetch_add(1);
+      // pairs with the fence in signal(): either it sees the sleeper or we see the move
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      _cond.wait(lk, [&]{ return (current = available()) >= sequence || halted(); });
+      _sleepers.fetch_sub(1, std::memory_order_relaxed);
+      return current;
+   }
+
+   void signal()
+   {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (_sleepers.load(std::memory_order_relaxed) == 0)
+         return;
+
+      std::lock_guard<std::mutex> lk(_mut);
+      _cond.notify_all();
+   }
+};
+
+namespace detail {
+
+// a sequence alone on its cache line, padded rather than over-aligned for C++14 new
+struct padded_sequence
+{
+   char _before[64];
+   std::atomic<std::int64_t> value {-1};
+   char _after[64];
+};
+
+}
+
+/**
+ * @brief The disruptor class
+ * LMAX Disruptor style ring buffer: every consumer sees every event, in order, without
+ * copies. Slots are preallocated T objects filled in place by a single producer thread.
+ * The producer publishes a cursor sequence, each consumer advances its own sequence and
+ * may trail other consumers (a dependency barrier); the producer does not lap the
+ * slowest consumer.
+ * Consumers are added before publishing starts, each is driven by one thread.
+ */
+template <typename T, typename WaitStrategy = blocking_wait>
+class disruptor
+{
+public:
+   class consumer
+   {
+      friend class disruptor;
+
+      disruptor& _ring;
+      std::vector<consumer const*> _after;
+      detail::padded_sequence _sequence;
+      std::atomic_bool _done {false};   // returned 0 from process()
+
+      std::int64_t available() const noexcept
+      {
+         auto limit = _ring._cursor.value.load(std::memory_order_acquire);
+         for (auto c : _after)
+            limit = std::min(limit, c->_sequence.value.load(std::memory_order_acquire));
+         return limit;
+      }
+
+      // Once halted a consumer may stop only after those it trails did, before that
+      // they may still release events to it.
+      bool may_finish() const noexcept
+      {
+         if (!_ring.halted())
+            return false;
+         for (auto c : _after)
+            if (!c->_done.load(std::memory_order_acquire))
+               return false;
+         return true;
+      }
+
+   public:
+      consumer(disruptor& ring, std::initializer_list<consumer const*> after)
+      : _ring(ring), _after(after)
+      {   }
+
+      consumer(consumer const&) = delete;
+      consumer& operator=(consumer const&) = delete;
+
+      // last processed sequence, -1 before the first event
+      std::int64_t sequence() const noexcept
+      {
+         return _sequence.value.load(std::memory_order_acquire);
+      }
+
+      /**
+       * Waits for the events after the last processed one and calls
+       * f(T&, sequence, end_of_batch) for all that are available, then releases them.
+       * Returns their count, 0 once the ring is halted, the consumers this one trails
+       * have finished and every published event is processed.
+       */
+      template <typename F>
+      std::size_t process(F&& f)
+      {
+         auto next = _sequence.value.load(std::memory_order_relaxed) + 1;
+         auto last = _ring._wait.wait_for(next, [this]{ return available(); },
+                                          [this]{ return may_finish(); });
+         if (last < next)
+         {
+            // the upstream consumers may have released their last events between the
+            // two checks in wait_for, look again after seeing them done
+            last = available();
+            if (last < next)
+            {
+               _done.store(true, std::memory_order_release);
+               _ring._wait.signal();
+               return 0;
+            }
+         }
+
+         for (auto s = next; s <= last; ++s)
+            f(_ring[s], s, s == last);
+
+         _sequence.value.store(last, std::memory_order_release);
+         _ring._wait.signal();
+         return static_cast<std::size_t>(last - next + 1);
+      }
+   };
+
+private:
+   std::int64_t const _mask;
+   std::unique_ptr<T[]> _slots;
+   std::vector<std::unique_ptr<consumer>> _consumers;
+   WaitStrategy _wait;
+   detail::padded_sequence _cursor;      // last published
+   std::int64_t _claimed {-1};           // producer only
+   std::int64_t _gate {-1};              // producer only, cached slowest consumer
+   std::atomic_bool _halted {false};
+
+   std::int64_t slowest() const noexcept
+   {
+      auto slowest = _cursor.value.load(std::memory_order_relaxed);
+      for (auto const& c : _consumers)
+         slowest = std::min(slowest, c->_sequence.value.load(std::memory_order_acquire));
+      return slowest;
+   }
+
+public:
+   // capacity is rounded up to a power of two
+   explicit disruptor(std::size_t capacity)
+   : _mask([capacity]{
+         std::int64_t rounded = 1;
+         while (rounded < static_cast<std::int64_t>(capacity))
+            rounded <<= 1;
+         return rounded - 1;
+      }())
+   , _slots(new T[static_cast<std::size_t>(_mask + 1)])
+   {   }
+
+   disruptor(disruptor const&) = delete;
+   disruptor& operator=(disruptor const&) = delete;
+
+   // Not thread-safe, call before publishing starts.
+   consumer& add_consumer(std::initializer_list<consumer const*> after = {})
+   {
+      _consumers.push_back(std::make_unique<consumer>(*this, after));
+      return *_consumers.back();
+   }
+
+   std::size_t capacity() const noexcept
+   {
+      return static_cast<std::size_t>(_mask + 1);
+   }
+
+   T& operator[](std::int64_t sequence) noexcept
+   {
+      return _slots[static_cast<std::size_t>(sequence & _mask)];
+   }
+
+   // Producer: waits for the slot of the next sequence to be released by all consumers.
+   std::int64_t claim()
+   {
+      auto next = ++_claimed;
+      auto wrap = next - (_mask + 1);
+      if (wrap > _gate)
+         _gate = _wait.wait_for(wrap, [this]{ return slowest(); }, []{ return false; });
+      return next;
+   }
+
+   // Producer: makes the claimed sequence (and all before it) visible to the consumers.
+   void publish(std::int64_t sequence)
+   {
+      _cursor.value.store(sequence, std::memory_order_release);
+      _wait.signal();
+   }
+
+   template <typename F>
+   void publish_event(F&& fill)
+   {
+      auto sequence = claim();
+      std::forward<F>(fill)((*this)[sequence]);
+      publish(sequence);
+   }
+
+   // Wakes the waiting consumers; each one's process() returns 0 once it has processed
+   // everything published and the consumers it trails have finished.
+   // Stop the producer first, it keeps waiting for consumers that no longer run.
+   void halt()
+   {
+      _halted.store(true);
+      _wait.signal();
+   }
+
+   bool halted() const noexcept
+   {
+      return _halted.load(std::memory_order_acquire);
+   }
+};
+
+}
@@ -0,0 +1,157 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+#include "utility/assert.hpp"
+
+/**
+ * Example
+ *
+ * struct buffer : parallel::stack_hook { char data[4096]; };
+ *
+ * parallel::lock_free_stack<buffer> free_buffers;
+ * free_buffers.push(new buffer);
+ * if (auto b = free_buffers.pop())            // the most recently returned, still hot
+ *    ...
+ * for (auto b = free_buffers.pop_all(); b; ) // take everything at once
+ * {
+ *    auto next = parallel::lock_free_stack<buffer>::next(b);
+ *    delete b;
+ *    b = next;
+ * }
+ */
+
+namespace parallel {
+
+// Base for the elements of a lock_free_stack
+struct stack_hook
+{
+   std::atomic<stack_hook*> stack_next {nullptr};
+};
+
+/**
+ * @brief The lock_free_stack class
+ * Intrusive Treiber stack. The stack does not own its nodes: a popped node may be pushed
+ * again or reused, but must stay allocated while other threads may still pop, since a
+ * losing pop reads the next link of a node it did not get (free lists and pools of
+ * recycled objects satisfy this).
+ * ABA is made unlikely, not impossible, by a 16 bit modification tag packed with the
+ * pointer into the head word: a pop stalled between its load and CAS can still be fooled
+ * if the head returns to the same node after exactly a multiple of 65536 updates.
+ * The packing relies on 48 bit user space addresses (x86-64, AArch64); 5-level paging
+ * (LA57) or a 52 bit address space breaks it, which pack() checks.
+ */
+template <typename T>
+class lock_free_stack
+{
+   static_assert(std::is_base_of<stack_hook, T>::value, "lock_free_stack: T must derive from stack_hook");
+   static_assert(sizeof(void*) == 8, "lock_free_stack: the tagged head needs 64 bit pointers");
+
+   static constexpr unsigned tag_shift = 48;
+   static constexpr std::uint64_t pointer_mask = (std::uint64_t{1} << tag_shift) - 1;
+
+   std::atomic<std::uint64_t> _head {0};
+
+   static stack_hook* pointer(std::uint64_t head) noexcept
+   {
+      return reinterpret_cast<stack_hook*>(head & pointer_mask);
+   }
+
+   // not noexcept so Expects can throw; push and pop are, so a bad pointer terminates
+   static std::uint64_t pack(stack_hook* p, std::uint64_t old_head)
+   {
+      // checked in release builds too, a pointer above 48 bits would be silently truncated
+      Expects((reinterpret_cast<std::uint64_t>(p) & ~pointer_mask) == 0);
+      auto tag = (old_head >> tag_shift) + 1;
+      return (tag << tag_shift) | reinterpret_cast<std::uint64_t>(p);
+   }
+
+public:
+   lock_free_stack() = default;
+   lock_free_stack(lock_free_stack const&) = delete;
+   lock_free_stack& operator=(lock_free_stack const&) = delete;
+
+   static T* next(T* node) noexcept
+   {
+      return static_cast<T*>(node->stack_next.load(std::memory_order_relaxed));
+   }
+
+   // Links node in front of next, to build a chain for push_chain.
+   static void link(T* node, T* next) noexcept
+   {
+      node->stack_next.store(next, std::memory_order_relaxed);
+   }
+
+   void push(T* node) noexcept
+   {
+      push_chain(node, node);
+   }
+
+   // Pushes first..last, linked with link(), in one CAS; first ends up on top.
+   void push_chain(T* first, T* last) noexcept
+   {
+      auto head = _head.load(std::memory_order_relaxed);
+      do
+      {
+         last->stack_next.store(pointer(head), std::memory_order_relaxed);
+      }
+      while (!_head.compare_exchange_weak(head, pack(first, head),
+                                          std::memory_order_release, std::memory_order_relaxed));
+   }
+
+   T* pop() noexcept
+   {
+      auto head = _head.load(std::memory_order_acquire);
+      while (auto top = pointer(head))
+      {
+         auto next = top->stack_next.load(std::memory_order_relaxed);
+         if (_head.compare_exchange_weak(head, pack(next, head),
+                                         std::memory_order_acquire, std::memory_order_acquire))
+            return static_cast<T*>(top);
+      }
+      return nullptr;
+   }
+
+   // Detaches the whole stack, top first, walk it with next().
+   T* pop_all() noexcept
+   {
+      auto head = _head.load(std::memory_order_relaxed);
+      while (pointer(head) && !_head.compare_exchange_weak(head, pack(nullptr, head),
+                                                            std::memory_order_acquire, std::memory_order_relaxed))
+         ;
+      return static_cast<T*>(pointer(head));
+   }
+
+   bool empty() const noexcept
+   {
+      return !pointer(_head.load(std::memory_order_relaxed));
+   }
+};
+
+}
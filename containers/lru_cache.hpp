@@ -0,0 +1,284 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * Example
+ *
+ * parallel::lru_cache<std::string, quote> quotes(10000);
+ * auto q = quotes.get_or_compute(symbol, [&]{ return fetch_quote(symbol); });
+ *
+ * // capacity in bytes
+ * parallel::lru_cache<std::string, std::string> pages(64 << 20, 16,
+ *    [](std::string const& url, std::string const& body){ return url.size() + body.size(); });
+ */
+
+namespace parallel {
+
+struct cache_stats
+{
+   std::uint64_t hits {0};
+   std::uint64_t misses {0};       // computed or not found
+   std::uint64_t coalesced {0};    // waited for a computation already running
+   std::uint64_t evictions {0};
+};
+
+/**
+ * @brief The lru_cache class
+ * Least recently used cache split into shards by key hash, each with its own mutex,
+ * list and index, so threads working on different keys rarely meet on a lock.
+ * The capacity is a total cost, split evenly over the shards; the cost function
+ * defaults to 1 per entry (a capacity by count).
+ * get_or_compute() runs fn outside the lock, and a thread missing on a key that is
+ * being computed waits for that result instead of computing it again. An exception
+ * from fn is rethrown to all of them and nothing is cached.
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key>>
+class lru_cache
+{
+public:
+   using tCost = std::function<std::size_t(Key const&, Value const&)>;
+
+private:
+   struct entry
+   {
+      Key key;
+      Value value;
+      std::size_t cost;
+   };
+
+   using tOrder = std::list<entry>;
+
+   struct shard
+   {
+      std::mutex mut;
+      tOrder order;                 // most recently used first
+      std::unordered_map<Key, typename tOrder::iterator, Hash, KeyEqual> index;
+      std::unordered_map<Key, std::shared_future<Value>, Hash, KeyEqual> pending;
+      std::size_t cost {0};
+      cache_stats stats;
+      char _pad[64];
+   };
+
+   Hash _hash;
+   std::size_t _shard_capacity;
+   unsigned _shard_bits {0};
+   std::unique_ptr<shard[]> _shards;
+   tCost _cost;
+
+   shard& shard_for(Key const& key) const
+   {
+      if (_shard_bits == 0)
+         return _shards[0];
+
+      // Fibonacci hashing, the top bits stay independent of the index buckets
+      std::uint64_t h = _hash(key);
+      return _shards[(h * 0x9e3779b97f4a7c15ull) >> (64 - _shard_bits)];
+   }
+
+   // under s.mut, marks the entry as most recently used
+   entry* lookup(shard& s, Key const& key)
+   {
+      auto found = s.index.find(key);
+      if (found == s.index.end())
+         return nullptr;
+
+      s.order.splice(s.order.begin(), s.order, found->second);
+      return &*found->second;
+   }
+
+   // under s.mut
+   void store(shard& s, Key const& key, Value value)
+   {
+      auto cost = _cost(key, value);
+      auto found = s.index.find(key);
+      if (found != s.index.end())
+      {
+         s.cost -= found->second->cost;
+         found->second->value = std::move(value);
+         found->second->cost = cost;
+         s.order.splice(s.order.begin(), s.order, found->second);
+      }
+      else
+      {
+         s.order.push_front(entry{key, std::move(value), cost});
+         s.index.emplace(key, s.order.begin());
+      }
+      s.cost += cost;
+
+      // an entry costing more than the shard stays alone
+      while (s.cost > _shard_capacity && s.order.size() > 1)
+      {
+         auto& victim = s.order.back();
+         s.cost -= victim.cost;
+         s.index.erase(victim.key);
+         s.order.pop_back();
+         ++s.stats.evictions;
+      }
+   }
+
+public:
+   // shards is rounded up to a power of two
+   explicit lru_cache(std::size_t capacity, std::size_t shards = 16,
+                      tCost cost = [](Key const&, Value const&) -> std::size_t { return 1; })
+   : _cost(std::move(cost))
+   {
+      std::size_t shards_count = 1;
+      while (shards_count < shards)
+      {
+         shards_count <<= 1;
+         ++_shard_bits;
+      }
+
+      _shard_capacity = (capacity + shards_count - 1) / shards_count;
+      _shards.reset(new shard[shards_count]);
+   }
+
+   lru_cache(lru_cache const&) = delete;
+   lru_cache& operator=(lru_cache const&) = delete;
+
+   bool get(Key const& key, Value& value)
+   {
+      auto& s = shard_for(key);
+      std::lock_guard<std::mutex> lk(s.mut);
+      if (auto hit = lookup(s, key))
+      {
+         ++s.stats.hits;
+         value = hit->value;
+         return true;
+      }
+
+      ++s.stats.misses;
+      return false;
+   }
+
+   void put(Key const& key, Value value)
+   {
+      auto& s = shard_for(key);
+      std::lock_guard<std::mutex> lk(s.mut);
+      store(s, key, std::move(value));
+   }
+
+   bool erase(Key const& key)
+   {
+      auto& s = shard_for(key);
+      std::lock_guard<std::mutex> lk(s.mut);
+      auto found = s.index.find(key);
+      if (found == s.index.end())
+         return false;
+
+      s.cost -= found->second->cost;
+      s.order.erase(found->second);
+      s.index.erase(found);
+      return true;
+   }
+
+   template <typename F>
+   Value get_or_compute(Key const& key, F&& fn)
+   {
+      auto& s = shard_for(key);
+      std::unique_lock<std::mutex> lk(s.mut);
+
+      if (auto hit = lookup(s, key))
+      {
+         ++s.stats.hits;
+         return hit->value;
+      }
+
+      auto running = s.pending.find(key);
+      if (running != s.pending.end())
+      {
+         ++s.stats.coalesced;
+         auto result = running->second;
+         lk.unlock();
+         return result.get();
+      }
+
+      ++s.stats.misses;
+      std::promise<Value> promise;
+      s.pending.emplace(key, promise.get_future().share());
+      lk.unlock();
+
+      try
+      {
+         Value value = std::forward<F>(fn)();
+         lk.lock();
+         store(s, key, value);
+         s.pending.erase(key);
+         lk.unlock();
+         promise.set_value(value);
+         return value;
+      }
+      catch (...)
+      {
+         if (!lk.owns_lock())
+            lk.lock();
+         s.pending.erase(key);
+         lk.unlock();
+         promise.set_exception(std::current_exception());
+         throw;
+      }
+   }
+
+   cache_stats stats() const
+   {
+      cache_stats total;
+      for (std::size_t i = 0; i < (std::size_t{1} << _shard_bits); ++i)
+      {
+         auto& s = _shards[i];
+         std::lock_guard<std::mutex> lk(s.mut);
+         total.hits += s.stats.hits;
+         total.misses += s.stats.misses;
+         total.coalesced += s.stats.coalesced;
+         total.evictions += s.stats.evictions;
+      }
+      return total;
+   }
+
+   std::size_t size() const
+   {
+      std::size_t total = 0;
+      for (std::size_t i = 0; i < (std::size_t{1} << _shard_bits); ++i)
+      {
+         auto& s = _shards[i];
+         std::lock_guard<std::mutex> lk(s.mut);
+         total += s.order.size();
+      }
+      return total;
+   }
+};
+
+}
@@ -25,19 +25,116 @@
 
 #pragma once
 
+#include <deque>
 #include <queue>
 #include <memory>
 #include <mutex>
+#include <functional>
 #include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "utility/stop_token.hpp"
 
 namespace parallel {
 
+// Thrown where a pop cannot report failure through its return value.
+struct queue_closed : std::runtime_error
+{
+   queue_closed() : std::runtime_error( "parallel::queue closed" )
+   {   }
+};
+
+enum class pop_status { popped, deferred, closed };
+
+// Turns elements into bytes and back for queue::spill_to. encode appends to out (a throw
+// counts as a failed spill), decode gets exactly the bytes one encode produced and must
+// not throw.
 template <typename T>
+struct spill_codec
+{
+   std::function<void( T const& value, std::string& out )> encode;
+   std::function<T( char const* data, std::size_t size )> decode;
+};
+
+// Keeps the encoded batches of queue::spill_to, oldest first; spill_log in
+// io/spill_log.hpp keeps them in files. append stores the whole batch or, throwing,
+// none of it.
+struct spill_storage
+{
+   virtual ~spill_storage() = default;
+   virtual void append( std::string const& batch ) = 0;
+   // Replaces batch with the oldest batch, returns false when there is none.
+   virtual bool read( std::string& batch ) = 0;
+};
+
+struct spill_options
+{
+   std::size_t watermark {1 << 16};   // elements held in memory before spilling
+   std::size_t batch {1024};          // elements per append and per read
+};
+
+/**
+ * Lock is any Lockable guarding the queue (std::mutex by default, or one of the
+ * locks from sync/spin_lock.hpp for very short critical sections).
+ *
+ * close() ends the queue: pushes are refused, waiters wake up and pops fail once the
+ * remaining elements are drained. The stop_token overloads of wait_and_pop sleep until
+ * data, close() or a stop request, whichever comes first.
+ * Allocator is used for the element storage, e.g. pool_allocator from
+ * utility/object_pool.hpp.
+ *
+ * After spill_to() the queue keeps at most about watermark + batch elements in memory.
+ * Once the front part holds watermark elements, newer ones collect behind it and are
+ * encoded in batches into a spill_storage; pops read them back a batch at a time when
+ * the front runs dry. The storage is used under the queue lock, by the pushing or
+ * popping thread that crosses a batch boundary. A failed append does not fail the push:
+ * the batch stays in memory, the error is kept for last_spill_error() and the next
+ * attempt is made once another batch has collected.
+ */
+template <typename T, typename Lock = std::mutex, typename Allocator = std::allocator<T>>
 class queue
 {
-   mutable std::mutex _mut;
-   std::queue<T> _q;
-   std::condition_variable _cond;
+   // Receives the element to move from, or nullptr once the queue is closed.
+   using tWaiter = std::function<void(T*)>;
+   using tCondition = std::conditional_t<std::is_same<Lock, std::mutex>::value,
+                                         std::condition_variable,
+                                         std::condition_variable_any>;
+
+   struct spill_state
+   {
+      spill_state( std::unique_ptr<spill_storage> st, spill_codec<T> c, spill_options o )
+         : storage( std::move( st ) ), codec( std::move( c ) ), options( o ), retry_at( o.batch )
+      {   }
+
+      std::unique_ptr<spill_storage> storage;
+      spill_codec<T> codec;
+      spill_options options;
+      std::deque<T, Allocator> tail;   // newer than everything in storage
+      std::size_t spilled {0};
+      std::string buffer;
+      std::size_t retry_at;            // tail size of the next append
+      std::size_t failures {0};
+      std::exception_ptr error;
+   };
+
+   mutable Lock _mut;
+   std::queue<T, std::deque<T, Allocator>> _q;
+   std::queue<tWaiter> _waiters;
+   tCondition _cond;
+   bool _closed {false};
+   std::unique_ptr<spill_state> _spill;
+
+   bool pop_front( T& value );
+   std::shared_ptr<T> pop_front_shared();
+   bool has_elements() const;
+   void store( T&& value );
+   void spill_batch();
+   bool refill();
 
 public:
    // TODO:
@@ -47,82 +144,338 @@ public:
    queue() = default;
    queue( queue const& other );
    
-   void push( T&&  new_value );
+   // Returns false and drops the value if the queue is closed.
+   bool push( T&&  new_value );
 
-   void wait_and_pop( T& value );
+   // Returns false once the queue is closed and drained.
+   bool wait_and_pop( T& value );
+   // Also returns false when a stop is requested through token.
+   bool wait_and_pop( T& value, stop_token const& token );
    //change shared_ptr to boost::optional
    std::shared_ptr<T> wait_and_pop();
+   std::shared_ptr<T> wait_and_pop( stop_token const& token );
    
    bool try_pop( T& value );
    //change shared_ptr to boost::optional
    std::shared_ptr<T> try_pop();
-   
+
+   // Pops into value if an element is available, otherwise registers waiter,
+   // which is invoked with the next pushed element on the pushing thread
+   // (or with nullptr on the closing thread).
+   pop_status pop_or_defer( T& value, tWaiter waiter );
+
+   void close();
+   bool closed() const;
+
+   // Enables the overflow into storage, e.g. a spill_log from io/spill_log.hpp.
+   // Throws std::logic_error if spilling is already on.
+   void spill_to( std::unique_ptr<spill_storage> storage, spill_codec<T> codec, spill_options options = {} );
+   // Number of elements currently in the spill storage.
+   std::size_t spilled() const;
+   // Appends that failed, and the exception of the last one.
+   std::size_t spill_failures() const;
+   std::exception_ptr last_spill_error() const;
+
    bool empty();	
 };	
 
-template <typename T>
-queue<T>::queue( queue const& other )
+template <typename T, typename Lock, typename Allocator>
+queue<T, Lock, Allocator>::queue( queue const& other )
 {
-   std::lock_guard<std::mutex> lk( _mut );   
+   std::lock_guard<Lock> lk( other._mut );
+   if ( other._spill && other._spill->spilled > 0 )
+      throw std::logic_error( "parallel::queue: cannot copy spilled elements" );
+
    _q = other._q;
+   if ( other._spill )
+      for ( auto const& value : other._spill->tail )
+         _q.push( value );
+   _closed = other._closed;
 }
 
-template <typename T>
-void queue<T>::push( T&& new_value )
+template <typename T, typename Lock, typename Allocator>
+bool queue<T, Lock, Allocator>::pop_front( T& value )
 {
-   std::lock_guard<std::mutex> lk( _mut );
-   _q.emplace( std::forward<T>( new_value ) );
-   _cond.notify_one();   
-}
+   if ( _q.empty() && !refill() )
+      return false;
 
-template <typename T>
-void queue<T>::wait_and_pop( T& value )
-{
-   std::unique_lock<std::mutex> lk( _mut );
-   _cond.wait( lk, [this]{ return !_q.empty(); });
-   value = _q.front();
+   value = std::move( _q.front() );
    _q.pop();
+   return true;
 }
 
-template <typename T>
-std::shared_ptr<T> queue<T>::wait_and_pop()
+// Builds the result straight from the front element, so T need not be default constructible.
+template <typename T, typename Lock, typename Allocator>
+std::shared_ptr<T> queue<T, Lock, Allocator>::pop_front_shared()
 {
-   std::unique_lock<std::mutex> lk( _mut );
-   _cond.wait( lk, [this]{ return !_q.empty(); });
-   auto res = std::make_shared<T>( _q.front() );
+   if ( _q.empty() && !refill() )
+      return nullptr;
+
+   auto res = std::make_shared<T>( std::move( _q.front() ) );
    _q.pop();
    return res;
 }
 
-template <typename T>
-bool queue<T>::try_pop( T& value )
+template <typename T, typename Lock, typename Allocator>
+bool queue<T, Lock, Allocator>::has_elements() const
+{
+   return !_q.empty() || ( _spill && ( _spill->spilled > 0 || !_spill->tail.empty() ) );
+}
+
+template <typename T, typename Lock, typename Allocator>
+void queue<T, Lock, Allocator>::store( T&& value )
+{
+   auto& s = *_spill;
+   if ( s.spilled == 0 && _q.size() + s.tail.size() < s.options.watermark )
+   {
+      for ( auto& v : s.tail )
+         _q.push( std::move( v ) );
+      s.tail.clear();
+      _q.push( std::move( value ) );
+      return;
+   }
+
+   s.tail.push_back( std::move( value ) );
+   if ( s.tail.size() < s.retry_at )
+      return;
+
+   try
+   {
+      spill_batch();
+      s.retry_at = s.options.batch;
+   }
+   catch ( ... )
+   {
+      // the value is queued already, so the push succeeds and nothing is retried per
+      // element; the batch stays in memory until the storage takes it
+      ++s.failures;
+      s.error = std::current_exception();
+      s.retry_at = s.tail.size() + s.options.batch;
+   }
+}
+
+// Writes the oldest batch of the tail. Records are a native uint32_t size followed by
+// the encoded bytes; the elements leave the tail only after the write succeeded.
+template <typename T, typename Lock, typename Allocator>
+void queue<T, Lock, Allocator>::spill_batch()
 {
-   std::lock_guard<std::mutex> lk( _mut );
-   if ( _q.empty() )
+   auto& s = *_spill;
+   auto end = s.tail.begin() + static_cast<std::ptrdiff_t>( s.options.batch );
+   s.buffer.clear();
+   for ( auto it = s.tail.begin(); it != end; ++it )
+   {
+      auto at = s.buffer.size();
+      s.buffer.append( sizeof( std::uint32_t ), '\0' );
+      s.codec.encode( *it, s.buffer );
+      auto size = static_cast<std::uint32_t>( s.buffer.size() - at - sizeof( std::uint32_t ) );
+      std::memcpy( &s.buffer[at], &size, sizeof( size ) );
+   }
+
+   s.storage->append( s.buffer );
+   s.tail.erase( s.tail.begin(), end );
+   s.spilled += s.options.batch;
+}
+
+// Called with an empty front: loads the oldest spilled batch, or takes the tail once
+// the disk is drained.
+template <typename T, typename Lock, typename Allocator>
+bool queue<T, Lock, Allocator>::refill()
+{
+   if ( !_spill )
       return false;
-   
-   value = _q.front();
-   _q.pop();
+
+   auto& s = *_spill;
+   if ( s.storage->read( s.buffer ) )
+   {
+      char const* p = s.buffer.data();
+      char const* end = p + s.buffer.size();
+      while ( p != end )
+      {
+         std::uint32_t size;
+         std::memcpy( &size, p, sizeof( size ) );
+         p += sizeof( size );
+         _q.push( s.codec.decode( p, size ) );
+         p += size;
+         --s.spilled;
+      }
+      return true;
+   }
+
+   if ( s.tail.empty() )
+      return false;
+
+   for ( auto& v : s.tail )
+      _q.push( std::move( v ) );
+   s.tail.clear();
    return true;
 }
 
-template <typename T>
-std::shared_ptr<T> queue<T>::try_pop()
+template <typename T, typename Lock, typename Allocator>
+bool queue<T, Lock, Allocator>::push( T&& new_value )
 {
-   std::lock_guard<std::mutex> lk( _mut );
-   if ( _q.empty() )
-      return nullptr;
+   std::unique_lock<Lock> lk( _mut );
+   if ( _closed )
+      return false;
 
-   auto res = std::make_shared<T>( _q.front() );
-   _q.pop();
-   return res;
+   if ( !_waiters.empty() )
+   {
+      auto waiter = std::move( _waiters.front() );
+      _waiters.pop();
+      lk.unlock();
+      waiter( &new_value );
+      return true;
+   }
+
+   if ( _spill )
+      store( std::move( new_value ) );
+   else
+      _q.emplace( std::forward<T>( new_value ) );
+   _cond.notify_one();   
+   return true;
 }
 
-template <typename T>
-bool queue<T>::empty()
+template <typename T, typename Lock, typename Allocator>
+bool queue<T, Lock, Allocator>::wait_and_pop( T& value )
+{
+   std::unique_lock<Lock> lk( _mut );
+   _cond.wait( lk, [this]{ return has_elements() || _closed; });
+   return pop_front( value );
+}
+
+template <typename T, typename Lock, typename Allocator>
+bool queue<T, Lock, Allocator>::wait_and_pop( T& value, stop_token const& token )
+{
+   // Registered before taking _mut: the callback locks it, so the notification
+   // cannot slip in between the predicate check and the wait.
+   stop_callback on_stop( token, [this]{
+      std::lock_guard<Lock> lk( _mut );
+      _cond.notify_all();
+   });
+
+   std::unique_lock<Lock> lk( _mut );
+   _cond.wait( lk, [this, &token]{
+      return has_elements() || _closed || token.stop_requested();
+   });
+   return !token.stop_requested() && pop_front( value );
+}
+
+template <typename T, typename Lock, typename Allocator>
+std::shared_ptr<T> queue<T, Lock, Allocator>::wait_and_pop()
+{
+   std::unique_lock<Lock> lk( _mut );
+   _cond.wait( lk, [this]{ return has_elements() || _closed; });
+   return pop_front_shared();
+}
+
+template <typename T, typename Lock, typename Allocator>
+std::shared_ptr<T> queue<T, Lock, Allocator>::wait_and_pop( stop_token const& token )
+{
+   stop_callback on_stop( token, [this]{
+      std::lock_guard<Lock> lk( _mut );
+      _cond.notify_all();
+   });
+
+   std::unique_lock<Lock> lk( _mut );
+   _cond.wait( lk, [this, &token]{
+      return has_elements() || _closed || token.stop_requested();
+   });
+   return token.stop_requested() ? nullptr : pop_front_shared();
+}
+
+template <typename T, typename Lock, typename Allocator>
+bool queue<T, Lock, Allocator>::try_pop( T& value )
+{
+   std::lock_guard<Lock> lk( _mut );
+   return pop_front( value );
+}
+
+template <typename T, typename Lock, typename Allocator>
+std::shared_ptr<T> queue<T, Lock, Allocator>::try_pop()
+{
+   std::lock_guard<Lock> lk( _mut );
+   return pop_front_shared();
+}
+
+template <typename T, typename Lock, typename Allocator>
+pop_status queue<T, Lock, Allocator>::pop_or_defer( T& value, tWaiter waiter )
+{
+   std::lock_guard<Lock> lk( _mut );
+   if ( pop_front( value ) )
+      return pop_status::popped;
+
+   if ( _closed )
+      return pop_status::closed;
+
+   _waiters.push( std::move( waiter ) );
+   return pop_status::deferred;
+}
+
+template <typename T, typename Lock, typename Allocator>
+void queue<T, Lock, Allocator>::close()
+{
+   std::queue<tWaiter> waiters;
+   {
+      std::lock_guard<Lock> lk( _mut );
+      if ( _closed )
+         return;
+
+      _closed = true;
+      std::swap( waiters, _waiters );
+      _cond.notify_all();
+   }
+
+   for ( ; !waiters.empty(); waiters.pop() )
+      waiters.front()( nullptr );
+}
+
+template <typename T, typename Lock, typename Allocator>
+bool queue<T, Lock, Allocator>::closed() const
+{
+   std::lock_guard<Lock> lk( _mut );
+   return _closed;
+}
+
+template <typename T, typename Lock, typename Allocator>
+void queue<T, Lock, Allocator>::spill_to( std::unique_ptr<spill_storage> storage, spill_codec<T> codec,
+                                          spill_options options )
+{
+   if ( !storage || options.batch == 0 )
+      throw std::invalid_argument( "parallel::queue: spilling needs a storage and a batch above 0" );
+
+   auto state = std::make_unique<spill_state>( std::move( storage ), std::move( codec ), options );
+
+   std::lock_guard<Lock> lk( _mut );
+   if ( _spill )
+      throw std::logic_error( "parallel::queue: spilling is already enabled" );
+   _spill = std::move( state );
+}
+
+template <typename T, typename Lock, typename Allocator>
+std::size_t queue<T, Lock, Allocator>::spilled() const
+{
+   std::lock_guard<Lock> lk( _mut );
+   return _spill ? _spill->spilled : 0;
+}
+
+template <typename T, typename Lock, typename Allocator>
+std::size_t queue<T, Lock, Allocator>::spill_failures() const
+{
+   std::lock_guard<Lock> lk( _mut );
+   return _spill ? _spill->failures : 0;
+}
+
+template <typename T, typename Lock, typename Allocator>
+std::exception_ptr queue<T, Lock, Allocator>::last_spill_error() const
+{
+   std::lock_guard<Lock> lk( _mut );
+   return _spill ? _spill->error : nullptr;
+}
+
+template <typename T, typename Lock, typename Allocator>
+bool queue<T, Lock, Allocator>::empty()
 {
-   std::lock_guard<std::mutex> lk( _mut );
-   return _q.empty();
+   std::lock_guard<Lock> lk( _mut );
+   return !has_elements();
 }
 
 }
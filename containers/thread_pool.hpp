@@ -25,29 +25,105 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
 #include <vector>
 #include <functional>
 #include <boost/range/irange.hpp>
 #include "queue.hpp"
+#include "timer_wheel.hpp"
 #include "raii/scoped_thread.hpp"
+#include "utility/object_pool.hpp"
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
 
 namespace parallel {
 
+enum class priority
+{
+   high,
+   normal,
+   low
+};
+
 class thread_pool
 {
    using tTask = std::function<void(void)>;
+   using clock = std::chrono::steady_clock;
+
+   struct timed_task
+   {
+      tTask task;
+      priority prio;
+   };
+
+   using tTimers = timer_wheel<timed_task>;
+
+   static constexpr std::size_t lanes_count = 3;
+   using timer_tick = std::chrono::milliseconds;
+   using blocking_keep_alive = std::chrono::seconds;
 
    std::atomic_bool _done {false};
+   // deque blocks come from the thread-caching pool instead of malloc
+   std::array<queue<tTask, std::mutex, pool_allocator<tTask>>, lanes_count> _work_q;
+
+   clock::time_point const _epoch {clock::now()};
+   std::mutex _timer_mut;
+   std::condition_variable _timer_cond;
+   tTimers _timers;
+
+   std::size_t const _blocking_max;
+   std::mutex _blocking_mut;
+   std::condition_variable _blocking_cond;
+   std::deque<tTask> _blocking_q;
+   std::size_t _blocking_idle {0};
+   std::vector<std::thread::id> _blocking_exited;
+   std::list<raii::join_thread> _blocking_threds;
+
    std::vector<raii::join_thread> _threds;
-   queue<tTask> _work_q;
+   raii::join_thread _timer_thred {&thread_pool::timer_thred, this};
+
+   // Weighted dequeue: every 4th round the normal lane is looked at first and
+   // every 16th round the low one, so a flood of high priority work can
+   // delay, but never starve, the lower lanes.
+   static priority first_lane(unsigned round)
+   {
+      if (round % 16 == 0)
+         return priority::low;
+      if (round % 4 == 0)
+         return priority::normal;
+      return priority::high;
+   }
+
+   bool pop_task(tTask& task, unsigned round)
+   {
+      auto first = static_cast<std::size_t>(first_lane(round));
+      if (_work_q[first].try_pop(task))
+         return true;
+
+      for (auto lane : boost::irange(lanes_count))
+      {
+         if (lane != first && _work_q[lane].try_pop(task))
+            return true;
+      }
+      return false;
+   }
 
    void worker_thred()
    {
+      unsigned round = 0;
       while (!_done)
       {
          tTask task;
-         if (_work_q.try_pop(task))
+         if (pop_task(task, ++round))
          {
             task();
          }
@@ -58,8 +134,104 @@ class thread_pool
       }
    }
 
+   // Single thread drives the wheel and hands due tasks over to the workers.
+   // It sleeps until the next tick the wheel has work for (a due slot or a cascade),
+   // or until a schedule moves that tick earlier.
+   void timer_thred()
+   {
+      std::unique_lock<std::mutex> lk(_timer_mut);
+      while (!_done)
+      {
+         _timers.advance(elapsed_ticks(clock::now()), [this](timed_task t){
+            submit(std::move(t.task), t.prio);
+         });
+
+         if (_timers.empty())
+            _timer_cond.wait(lk);
+         else
+            _timer_cond.wait_until(lk, _epoch + timer_tick(_timers.next_tick()));
+      }
+   }
+
+   // Auxiliary threads for blocking calls. They are spawned on demand up to
+   // _blocking_max and exit after staying idle for a keep-alive period.
+   void blocking_thred()
+   {
+      std::unique_lock<std::mutex> lk(_blocking_mut);
+      while (!_done)
+      {
+         if (_blocking_q.empty())
+         {
+            ++_blocking_idle;
+            auto woken = _blocking_cond.wait_for(lk, blocking_keep_alive(1), [this]{
+               return _done || !_blocking_q.empty();
+            });
+            --_blocking_idle;
+            if (!woken || _done)
+               break;
+         }
+
+         auto task = std::move(_blocking_q.front());
+         _blocking_q.pop_front();
+         lk.unlock();
+         task();
+         lk.lock();
+      }
+      _blocking_exited.push_back(std::this_thread::get_id());
+   }
+
+   // called under _blocking_mut
+   void reap_blocking_threds()
+   {
+      for (auto id : _blocking_exited)
+      {
+         _blocking_threds.remove_if([id](raii::join_thread& t){ return t.get().get_id() == id; });
+      }
+      _blocking_exited.clear();
+   }
+
+   tTimers::tick_type elapsed_ticks(clock::time_point time) const
+   {
+      return time <= _epoch ? 0 : (time - _epoch) / timer_tick(1);
+   }
+
+   static tTimers::tick_type ticks_ceil(clock::duration d)
+   {
+      auto ticks = std::chrono::duration_cast<timer_tick>(d);
+      if (ticks < d)
+         ++ticks;
+      return ticks.count() > 0 ? ticks.count() : 0;
+   }
+
+   tTimers::id_type schedule(clock::time_point time, tTimers::tick_type period, tTask task, priority p)
+   {
+      std::lock_guard<std::mutex> lk(_timer_mut);
+      auto was_empty = _timers.empty();
+      auto wake_at = _timers.next_tick();
+      auto id = _timers.schedule(ticks_ceil(time - _epoch), timed_task{std::move(task), p}, period);
+      if (was_empty || _timers.next_tick() < wake_at)
+         _timer_cond.notify_one();
+      return id;
+   }
+
+   void stop()
+   {
+      _done = true;
+      {
+         std::lock_guard<std::mutex> lk(_timer_mut);
+      }
+      _timer_cond.notify_all();
+      {
+         std::lock_guard<std::mutex> lk(_blocking_mut);
+      }
+      _blocking_cond.notify_all();
+   }
+
 public:
-   thread_pool()
+   using timer_id = tTimers::id_type;
+
+   explicit thread_pool(std::size_t max_blocking_threads = 64)
+   : _blocking_max(std::max<std::size_t>(max_blocking_threads, 1))
    {
       auto thread_counter = std::thread::hardware_concurrency();
 
@@ -71,20 +243,96 @@ public:
       }
       catch(...)
       {
-         _done = true;
+         stop();
          throw;
       }
    }
 
    ~thread_pool()
    {
-      _done = true;
+      stop();
    }
 
-   void submit(tTask task)
+   void submit(tTask task, priority p = priority::normal)
+   {
+      _work_q[static_cast<std::size_t>(p)].push(std::move(task));
+   }
+
+   /**
+    * Runs a task that may block (file I/O, fsync, sleeping syscalls) on the auxiliary
+    * blocking threads, so it never occupies one of the CPU workers.
+    * If given, 'then' is submitted to the CPU workers once the task has finished.
+    */
+   void submit_blocking(tTask task, tTask then = nullptr, priority p = priority::normal)
+   {
+      std::lock_guard<std::mutex> lk(_blocking_mut);
+      _blocking_q.emplace_back([this, task = std::move(task), then = std::move(then), p]() mutable {
+         task();
+         if (then)
+            submit(std::move(then), p);
+      });
+
+      if (_blocking_q.size() > _blocking_idle && _blocking_threds.size() - _blocking_exited.size() < _blocking_max)
+      {
+         reap_blocking_threds();
+         _blocking_threds.emplace_back(&thread_pool::blocking_thred, this);
+      }
+      _blocking_cond.notify_one();
+   }
+
+   timer_id submit_at(clock::time_point time, tTask task, priority p = priority::normal)
+   {
+      return schedule(time, 0, std::move(task), p);
+   }
+
+   template <typename Rep, typename Period>
+   timer_id submit_after(std::chrono::duration<Rep, Period> delay, tTask task, priority p = priority::normal)
+   {
+      return submit_at(clock::now() + std::chrono::duration_cast<clock::duration>(delay), std::move(task), p);
+   }
+
+   // First run is one period from now. The task is copied for every run.
+   template <typename Rep, typename Period>
+   timer_id submit_every(std::chrono::duration<Rep, Period> period, tTask task, priority p = priority::normal)
+   {
+      auto interval = std::chrono::duration_cast<clock::duration>(period);
+      return schedule(clock::now() + interval, std::max<tTimers::tick_type>(1, ticks_ceil(interval)), std::move(task), p);
+   }
+
+   // Returns false if the timer has already fired (one-shot) or was cancelled.
+   bool cancel(timer_id id)
+   {
+      std::lock_guard<std::mutex> lk(_timer_mut);
+      return _timers.cancel(id);
+   }
+
+#if defined(__cpp_impl_coroutine)
+   class schedule_awaiter
+   {
+      thread_pool& _pool;
+      priority _prio;
+
+   public:
+      schedule_awaiter(thread_pool& pool, priority p) noexcept
+      : _pool(pool), _prio(p)
+      {   }
+
+      bool await_ready() const noexcept { return false; }
+
+      void await_suspend(std::coroutine_handle<> h)
+      {
+         _pool.submit([h]{ h.resume(); }, _prio);
+      }
+
+      void await_resume() const noexcept {}
+   };
+
+   // co_await pool.schedule(); continues the coroutine on a worker
+   schedule_awaiter schedule(priority p = priority::normal) noexcept
    {
-      _work_q.push(std::move(task));
+      return {*this, p};
    }
+#endif
 };
 
 }
@@ -0,0 +1,246 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace parallel {
+
+/**
+ * @brief The timer_wheel class
+ * Hierarchical timing wheel (4 levels of 64 slots) keyed by an abstract tick counter.
+ * schedule() and cancel() are O(1); advance() walks the elapsed ticks, cascading the
+ * coarse levels down as their slots come due, and hands expired payloads to a callback.
+ * Entries due further than 64^4 ticks ahead are parked in the last level and cascaded
+ * again until they fit.
+ * Each level keeps a bitmap of its non-empty slots, so next_tick() finds the next tick
+ * with work in a few bit scans and advance() jumps over the empty ones.
+ * Not thread-safe, the owner serializes access.
+ */
+template <typename T>
+class timer_wheel
+{
+public:
+   using id_type = std::uint64_t;
+   using tick_type = std::uint64_t;
+
+private:
+   static constexpr unsigned slot_bits = 6;
+   static constexpr unsigned slots_count = 1u << slot_bits;
+   static constexpr tick_type slot_mask = slots_count - 1;
+   static constexpr unsigned levels_count = 4;
+
+   struct entry
+   {
+      id_type id;
+      tick_type expires;
+      tick_type period;
+      T payload;
+      unsigned level;
+      unsigned slot;
+   };
+
+   using slot_list = std::list<entry>;
+   using level_slots = std::array<slot_list, slots_count>;
+
+   std::array<level_slots, levels_count> _levels;
+   std::array<std::uint64_t, levels_count> _occupied {};   // bit per non-empty slot
+   std::unordered_map<id_type, typename slot_list::iterator> _index;
+   tick_type _next {0};
+   id_type _last_id {0};
+
+public:
+   explicit timer_wheel(tick_type start = 0) : _next(start)
+   {   }
+
+   timer_wheel(timer_wheel const&) = delete;
+   timer_wheel& operator=(timer_wheel const&) = delete;
+
+   // period == 0 schedules a one-shot entry
+   id_type schedule(tick_type expires, T payload, tick_type period = 0)
+   {
+      slot_list staging;
+      staging.push_back(entry{++_last_id, expires, period, std::move(payload), 0, 0});
+      auto it = staging.begin();
+      place(staging, it);
+      _index.emplace(it->id, it);
+      return it->id;
+   }
+
+   bool cancel(id_type id)
+   {
+      auto found = _index.find(id);
+      if (found == _index.end())
+         return false;
+
+      auto it = found->second;
+      auto level = it->level;
+      auto slot = it->slot;
+      _levels[level][slot].erase(it);
+      if (_levels[level][slot].empty())
+         _occupied[level] &= ~(std::uint64_t{1} << slot);
+      _index.erase(found);
+      return true;
+   }
+
+   bool empty() const noexcept
+   {
+      return _index.empty();
+   }
+
+   std::size_t size() const noexcept
+   {
+      return _index.size();
+   }
+
+   /**
+    * The first tick from which advance() has something to do: an entry to expire or a
+    * slot to cascade. Equal to the next unprocessed tick while the wheel is empty.
+    */
+   tick_type next_tick() const noexcept
+   {
+      if (empty())
+         return _next;
+
+      auto earliest = ~tick_type{0};
+      for (unsigned level = 0; level < levels_count; ++level)
+      {
+         if (_occupied[level] == 0)
+            continue;
+
+         // slot s of this level is handled at the first tick >= _next that is
+         // base + s * unit, wrapping into the next rotation of the level
+         auto const shift = level * slot_bits;
+         auto const unit = tick_type{1} << shift;
+         auto const base = _next >> (shift + slot_bits) << (shift + slot_bits);
+         auto const first = (_next - base + unit - 1) >> shift;
+
+         auto later = first < slots_count ? _occupied[level] >> first << first : 0;
+         auto tick = later != 0
+                   ? base + (tick_type(__builtin_ctzll(later)) << shift)
+                   : base + (tick_type(__builtin_ctzll(_occupied[level])) << shift) + (unit << slot_bits);
+         earliest = std::min(earliest, tick);
+      }
+      return earliest;
+   }
+
+   /**
+    * Processes all ticks up to and including 'now'.
+    * fire(T) receives a moved payload for one-shot entries and a copy for periodic ones.
+    */
+   template <typename Fire>
+   void advance(tick_type now, Fire&& fire)
+   {
+      while (_next <= now)
+      {
+         // ticks before it have nothing to cascade or expire
+         auto due = next_tick();
+         if (empty() || due > now)
+         {
+            _next = now + 1;
+            return;
+         }
+         _next = due;
+
+         auto index = _next & slot_mask;
+         for (unsigned level = 1; index == 0 && level < levels_count; ++level)
+         {
+            index = (_next >> (level * slot_bits)) & slot_mask;
+            cascade(level, static_cast<unsigned>(index));
+         }
+
+         expire(static_cast<unsigned>(_next & slot_mask), fire);
+         ++_next;
+      }
+   }
+
+private:
+   void place(slot_list& from, typename slot_list::iterator it)
+   {
+      auto expires = it->expires < _next ? _next : it->expires;
+      auto delta = expires - _next;
+
+      unsigned level = 0;
+      while (level + 1 < levels_count && delta >= (tick_type{1} << ((level + 1) * slot_bits)))
+         ++level;
+
+      auto const range = tick_type{1} << (levels_count * slot_bits);
+      if (delta >= range)
+         expires = _next + range - 1;
+
+      it->level = level;
+      it->slot = static_cast<unsigned>((expires >> (level * slot_bits)) & slot_mask);
+      auto& to = _levels[it->level][it->slot];
+      to.splice(to.end(), from, it);
+      _occupied[it->level] |= std::uint64_t{1} << it->slot;
+   }
+
+   // Moves a whole slot out, clearing its bit; place() sets the bits of the new slots.
+   void take(unsigned level, unsigned index, slot_list& to)
+   {
+      to.splice(to.end(), _levels[level][index]);
+      _occupied[level] &= ~(std::uint64_t{1} << index);
+   }
+
+   void cascade(unsigned level, unsigned index)
+   {
+      slot_list pending;
+      take(level, index, pending);
+      while (!pending.empty())
+         place(pending, pending.begin());
+   }
+
+   template <typename Fire>
+   void expire(unsigned index, Fire& fire)
+   {
+      slot_list due;
+      take(0, index, due);
+      while (!due.empty())
+      {
+         auto it = due.begin();
+         if (it->period == 0)
+         {
+            _index.erase(it->id);
+            auto payload = std::move(it->payload);
+            due.erase(it);
+            fire(std::move(payload));
+         }
+         else
+         {
+            it->expires = std::max(it->expires + it->period, _next + 1);
+            place(due, it);
+            fire(T(it->payload));
+         }
+      }
+   }
+};
+
+}
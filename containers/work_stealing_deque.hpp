@@ -0,0 +1,195 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Example
+ *
+ * parallel::work_stealing_deque<job*> local;   // one per worker
+ * local.push(j);                               // owner only
+ * job* next;
+ * if (local.pop(next) || victim.steal(next))   // steal from any thread
+ *    next->run();
+ */
+
+namespace parallel {
+
+/**
+ * @brief The work_stealing_deque class
+ * Chase-Lev deque with the memory orderings of Le, Pop, Cohen and Zappa Nardelli,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).
+ * The owner thread pushes and pops at the bottom (LIFO), any thread steals from the top
+ * (FIFO). Only the last element is contended, via a CAS on top.
+ * The circular buffer doubles when full; retired buffers are kept until destruction
+ * because a thief may still read from them.
+ * T is stored in atomics, so it must be trivially copyable (a pointer or an index).
+ */
+template <typename T>
+class work_stealing_deque
+{
+   static_assert(std::is_trivially_copyable<T>::value, "work_stealing_deque stores T in atomics");
+
+   class ring
+   {
+      std::int64_t _mask;
+      std::unique_ptr<std::atomic<T>[]> _slots;
+
+   public:
+      explicit ring(std::int64_t capacity)
+      : _mask(capacity - 1), _slots(new std::atomic<T>[static_cast<std::size_t>(capacity)])
+      {   }
+
+      std::int64_t capacity() const noexcept { return _mask + 1; }
+
+      T get(std::int64_t i) const noexcept
+      {
+         return _slots[static_cast<std::size_t>(i & _mask)].load(std::memory_order_relaxed);
+      }
+
+      void put(std::int64_t i, T value) noexcept
+      {
+         _slots[static_cast<std::size_t>(i & _mask)].store(value, std::memory_order_relaxed);
+      }
+
+      std::unique_ptr<ring> grow(std::int64_t bottom, std::int64_t top) const
+      {
+         auto bigger = std::make_unique<ring>(capacity() * 2);
+         for (auto i = top; i != bottom; ++i)
+            bigger->put(i, get(i));
+         return bigger;
+      }
+   };
+
+   // top and bottom on their own cache lines: thieves hammer top, the owner bottom.
+   // padded rather than over-aligned, C++14 new ignores extended alignment
+   std::atomic<std::int64_t> _top {0};
+   char _pad_top[64];
+   std::atomic<std::int64_t> _bottom {0};
+   char _pad_bottom[64];
+   std::atomic<ring*> _ring;
+   std::vector<std::unique_ptr<ring>> _rings;   // owner only, the current one is last
+
+public:
+   // capacity is rounded up to a power of two
+   explicit work_stealing_deque(std::size_t capacity = 64)
+   {
+      std::int64_t rounded = 1;
+      while (rounded < static_cast<std::int64_t>(capacity))
+         rounded <<= 1;
+
+      _rings.push_back(std::make_unique<ring>(rounded));
+      _ring.store(_rings.back().get(), std::memory_order_relaxed);
+   }
+
+   work_stealing_deque(work_stealing_deque const&) = delete;
+   work_stealing_deque& operator=(work_stealing_deque const&) = delete;
+
+   // owner only
+   void push(T value)
+   {
+      auto b = _bottom.load(std::memory_order_relaxed);
+      auto t = _top.load(std::memory_order_acquire);
+      auto r = _ring.load(std::memory_order_relaxed);
+
+      if (b - t > r->capacity() - 1)
+      {
+         _rings.push_back(r->grow(b, t));
+         r = _rings.back().get();
+         _ring.store(r, std::memory_order_release);
+      }
+
+      r->put(b, value);
+      std::atomic_thread_fence(std::memory_order_release);
+      _bottom.store(b + 1, std::memory_order_relaxed);
+   }
+
+   // owner only, takes the most recently pushed element
+   bool pop(T& value)
+   {
+      auto b = _bottom.load(std::memory_order_relaxed) - 1;
+      auto r = _ring.load(std::memory_order_relaxed);
+      // store + seq_cst fence in the paper; a seq_cst exchange is the same barrier
+      // and compiles to a single xchg instead of mov + mfence on x86
+      _bottom.exchange(b, std::memory_order_seq_cst);
+      auto t = _top.load(std::memory_order_seq_cst);
+
+      if (t > b)
+      {
+         _bottom.store(b + 1, std::memory_order_relaxed);
+         return false;
+      }
+
+      value = r->get(b);
+      if (t == b)
+      {
+         // last element, race the thieves for it
+         bool won = _top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                 std::memory_order_relaxed);
+         _bottom.store(b + 1, std::memory_order_relaxed);
+         return won;
+      }
+      return true;
+   }
+
+   // any thread, takes the oldest element; false if empty or lost a race
+   bool steal(T& value)
+   {
+      auto t = _top.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      auto b = _bottom.load(std::memory_order_acquire);
+
+      if (t >= b)
+         return false;
+
+      auto r = _ring.load(std::memory_order_acquire);
+      auto stolen = r->get(t);
+      if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed))
+         return false;
+
+      value = stolen;
+      return true;
+   }
+
+   // a snapshot, exact only when called by the owner with no thieves around
+   std::size_t size() const noexcept
+   {
+      auto b = _bottom.load(std::memory_order_relaxed);
+      auto t = _top.load(std::memory_order_relaxed);
+      return b > t ? static_cast<std::size_t>(b - t) : 0;
+   }
+
+   bool empty() const noexcept { return size() == 0; }
+};
+
+}
@@ -0,0 +1,435 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "containers/lock_free_stack.hpp"
+#include "raii/scoped_thread.hpp"
+#include "utility/object_pool.hpp"
+
+/**
+ * Example
+ *
+ * parallel::async_logger log("/var/log/engine.log");
+ * pool.submit([&log]{
+ *    log.logf("order %d filled at %.2f", id, price);
+ * });
+ * log.flush();   // written and synced
+ */
+
+namespace parallel {
+
+enum class overflow_policy
+{
+   block,   // the producer waits for the writer
+   drop,    // the record is discarded
+   count    // discarded too, and the writer adds a line with the number of records lost
+};
+
+struct async_logger_options
+{
+   std::size_t capacity {1 << 16};                  // records queued before overflow applies
+   overflow_policy overflow {overflow_policy::block};
+   std::size_t batch_bytes {64 << 10};              // queued bytes that wake the writer early
+   std::chrono::milliseconds flush_interval {20};   // longest a record waits to be written
+   bool sync_on_flush {true};                       // fdatasync in flush() and on shutdown
+};
+
+/**
+ * @brief The async_logger class
+ * Appends lines to a file from a background writer, so producers (thread_pool workers
+ * for instance) never wait for the disk. A producer formats its line into a record from
+ * its own thread cache of fixed_size_pool blocks and pushes it onto a lock_free_stack;
+ * no lock is taken unless the queue is full under overflow_policy::block. The writer
+ * thread takes the whole stack at once, restores the order and writes it with writev
+ * when batch_bytes are queued or flush_interval has passed.
+ * Lines of one thread keep their order; lines of different threads are ordered by the
+ * moment their push completed. The destructor writes everything submitted and syncs the
+ * file; logging concurrently with the destructor is undefined.
+ */
+class async_logger
+{
+   struct record : stack_hook
+   {
+      static constexpr std::size_t block_size = 256;
+      static constexpr std::size_t inline_size = block_size - sizeof(stack_hook)
+                                               - sizeof(std::size_t) - sizeof(char*);
+
+      std::size_t size {0};
+      char* text {buffer};   // buffer, or a heap copy for long lines
+      char buffer[inline_size];
+   };
+
+   static_assert(sizeof(record) == record::block_size, "async_logger: record must fill its block");
+   using tPool = fixed_size_pool<sizeof(record)>;
+
+   async_logger_options _options;
+   int _fd {-1};
+
+   // Hot words a cache line apart. Padded rather than over-aligned, C++14 new ignores
+   // extended alignment and the logger is often heap allocated.
+   char _pad0[64];
+   lock_free_stack<record> _records;
+   char _pad1[64];
+   std::atomic<std::size_t> _pending {0};         // records not written yet
+   char _pad2[64];
+   std::atomic<std::size_t> _pending_bytes {0};
+   char _pad3[64];
+   std::atomic<std::uint64_t> _submitted {0};
+   char _pad4[64];
+   std::atomic<std::uint64_t> _written {0};
+   char _pad5[64];
+   std::atomic<std::uint64_t> _dropped {0};
+   std::atomic<std::uint64_t> _write_errors {0};
+
+   std::mutex _mut;
+   std::condition_variable _wake;    // for the writer
+   std::condition_variable _space;   // for blocked producers
+   std::condition_variable _done;    // for flush()
+   std::size_t _blocked {0};
+   std::uint64_t _flush_target {0};
+   std::uint64_t _flushed {0};
+
+   raii::join_thread _writer;
+
+   static int open_file(std::string const& path)
+   {
+      auto fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      if (fd < 0)
+         throw std::system_error(errno, std::system_category(), "async_logger: open");
+      return fd;
+   }
+
+   record* reserve()
+   {
+      while (_pending.fetch_add(1, std::memory_order_relaxed) >= _options.capacity)
+      {
+         _pending.fetch_sub(1, std::memory_order_relaxed);
+         if (_options.overflow != overflow_policy::block)
+         {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+         }
+
+         std::unique_lock<std::mutex> lk(_mut);
+         ++_blocked;
+         _wake.notify_one();
+         _space.wait(lk, [this]{ return _pending.load(std::memory_order_relaxed) < _options.capacity; });
+         --_blocked;
+      }
+
+      try
+      {
+         return new (tPool::instance().allocate()) record;
+      }
+      catch (...)
+      {
+         unreserve();
+         throw;
+      }
+   }
+
+   // Gives back a reservation that will not be submitted, blocked producers may use it.
+   void unreserve()
+   {
+      _pending.fetch_sub(1, std::memory_order_relaxed);
+      std::lock_guard<std::mutex> lk(_mut);
+      if (_blocked > 0)
+         _space.notify_all();
+   }
+
+   // Moves the text to the heap for lines that do not fit the record; on failure the
+   // record and its reservation are given back before the exception leaves.
+   void allocate_text(record* r, std::size_t size)
+   {
+      try
+      {
+         r->text = new char[size];
+      }
+      catch (...)
+      {
+         release(r);
+         unreserve();
+         throw;
+      }
+   }
+
+   void submit(record* r)
+   {
+      r->text[r->size++] = '\n';
+      auto size = r->size;
+      _submitted.fetch_add(1, std::memory_order_relaxed);
+      _records.push(r);
+
+      // only the push that crosses the threshold wakes the writer
+      auto before = _pending_bytes.fetch_add(size, std::memory_order_relaxed);
+      if (before < _options.batch_bytes && before + size >= _options.batch_bytes)
+      {
+         std::lock_guard<std::mutex> lk(_mut);
+         _wake.notify_one();
+      }
+   }
+
+   static void release(record* r) noexcept
+   {
+      if (r->text != r->buffer)
+         delete[] r->text;
+      r->~record();
+      tPool::instance().deallocate(r);
+   }
+
+   void write_all(std::vector<iovec>& iov)
+   {
+      auto first = iov.data();
+      auto left = iov.size();
+      while (left > 0)
+      {
+         auto n = ::writev(_fd, first, static_cast<int>(std::min<std::size_t>(left, IOV_MAX)));
+         if (n < 0)
+         {
+            if (errno == EINTR)
+               continue;
+            _write_errors.fetch_add(1, std::memory_order_relaxed);
+            return;
+         }
+
+         // skip what was written, a partial write may end inside an entry
+         auto written = static_cast<std::size_t>(n);
+         while (left > 0 && written >= first->iov_len)
+         {
+            written -= first->iov_len;
+            ++first;
+            --left;
+         }
+         if (left > 0)
+         {
+            first->iov_base = static_cast<char*>(first->iov_base) + written;
+            first->iov_len -= written;
+         }
+      }
+   }
+
+   // Writes whatever is on the stack now, oldest first.
+   void write_pending(std::vector<record*>& batch, std::vector<iovec>& iov, std::string& note, std::uint64_t& reported)
+   {
+      batch.clear();
+      for (auto r = _records.pop_all(); r; r = lock_free_stack<record>::next(r))
+         batch.push_back(r);
+
+      iov.clear();
+      std::size_t bytes = 0;
+      for (auto it = batch.rbegin(); it != batch.rend(); ++it)
+      {
+         iov.push_back({(*it)->text, (*it)->size});
+         bytes += (*it)->size;
+      }
+
+      auto dropped = _dropped.load(std::memory_order_relaxed);
+      if (_options.overflow == overflow_policy::count && dropped != reported)
+      {
+         note = "parallel::async_logger: " + std::to_string(dropped - reported) + " records dropped\n";
+         iov.push_back({&note[0], note.size()});
+         reported = dropped;
+      }
+
+      if (iov.empty())
+         return;
+
+      write_all(iov);
+      for (auto r : batch)
+         release(r);
+
+      _pending_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+      _pending.fetch_sub(batch.size(), std::memory_order_relaxed);
+      _written.fetch_add(batch.size(), std::memory_order_release);
+
+      std::lock_guard<std::mutex> lk(_mut);
+      if (_blocked > 0)
+         _space.notify_all();
+   }
+
+   void run(stop_token token)
+   {
+      stop_callback on_stop(token, [this]{
+         std::lock_guard<std::mutex> lk(_mut);
+         _wake.notify_one();
+      });
+
+      std::vector<record*> batch;
+      std::vector<iovec> iov;
+      std::string note;
+      std::uint64_t reported = 0;
+      for (;;)
+      {
+         std::uint64_t target;
+         {
+            std::unique_lock<std::mutex> lk(_mut);
+            _wake.wait_for(lk, _options.flush_interval, [this, &token]{
+               return token.stop_requested() || _blocked > 0 || _flush_target > _flushed
+                   || _pending_bytes.load(std::memory_order_relaxed) >= _options.batch_bytes;
+            });
+            target = _flush_target > _flushed ? _flush_target : 0;
+         }
+
+         auto stopping = token.stop_requested();
+         if (stopping)
+            target = _submitted.load();
+
+         write_pending(batch, iov, note, reported);
+         if (target == 0 && !stopping)
+            continue;
+
+         // records counted in target may still be on their way onto the stack
+         while (_written.load(std::memory_order_acquire) < target)
+         {
+            std::this_thread::yield();
+            write_pending(batch, iov, note, reported);
+         }
+         if (_options.sync_on_flush)
+            ::fdatasync(_fd);
+
+         {
+            std::lock_guard<std::mutex> lk(_mut);
+            if (_flushed < target)
+               _flushed = target;
+            _done.notify_all();
+         }
+         if (stopping)
+            return;
+      }
+   }
+
+public:
+   // Opens path for appending, creating it if needed; throws std::system_error.
+   explicit async_logger(std::string const& path, async_logger_options options = {})
+      : _options(options)
+      , _fd(open_file(path))
+      , _writer([this](stop_token token){ run(std::move(token)); })
+   {   }
+
+   async_logger(async_logger const&) = delete;
+   async_logger& operator=(async_logger const&) = delete;
+
+   ~async_logger()
+   {
+      _writer.request_stop();
+      _writer.get().join();
+      ::close(_fd);
+   }
+
+   // Queues text plus a newline; returns false if the record was dropped.
+   bool write(char const* text, std::size_t size)
+   {
+      auto r = reserve();
+      if (!r)
+         return false;
+
+      if (size + 1 > record::inline_size)
+         allocate_text(r, size + 1);
+      std::memcpy(r->text, text, size);
+      r->size = size;
+      submit(r);
+      return true;
+   }
+
+   bool write(std::string const& text)
+   {
+      return write(text.data(), text.size());
+   }
+
+   // printf-style, formatted on the calling thread; returns false if the record was dropped.
+   bool logf(char const* format, ...) __attribute__((format(printf, 2, 3)))
+   {
+      auto r = reserve();
+      if (!r)
+         return false;
+
+      va_list args;
+      va_start(args, format);
+      auto n = std::vsnprintf(r->buffer, record::inline_size, format, args);
+      va_end(args);
+      if (n < 0)
+         n = 0;
+      else if (static_cast<std::size_t>(n) + 1 > record::inline_size)
+      {
+         allocate_text(r, static_cast<std::size_t>(n) + 1);
+         va_start(args, format);
+         std::vsnprintf(r->text, static_cast<std::size_t>(n) + 1, format, args);
+         va_end(args);
+      }
+
+      r->size = static_cast<std::size_t>(n);
+      submit(r);
+      return true;
+   }
+
+   // Returns once everything submitted before the call is written (and synced with
+   // sync_on_flush).
+   void flush()
+   {
+      auto target = _submitted.load();
+      std::unique_lock<std::mutex> lk(_mut);
+      if (_flush_target < target)
+         _flush_target = target;
+      _wake.notify_one();
+      _done.wait(lk, [this, target]{ return _flushed >= target; });
+   }
+
+   std::uint64_t written() const noexcept
+   {
+      return _written.load(std::memory_order_relaxed);
+   }
+
+   std::uint64_t dropped() const noexcept
+   {
+      return _dropped.load(std::memory_order_relaxed);
+   }
+
+   std::uint64_t write_errors() const noexcept
+   {
+      return _write_errors.load(std::memory_order_relaxed);
+   }
+};
+
+}
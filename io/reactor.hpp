@@ -0,0 +1,254 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+#include "containers/thread_pool.hpp"
+#include "raii/scoped_thread.hpp"
+
+/**
+ * Example
+ *
+ * parallel::thread_pool pool;
+ * parallel::reactor r(pool);
+ * r.add(fd, EPOLLIN, [](int fd, std::uint32_t events){ read until EAGAIN.. }, parallel::reactor::edge);
+ */
+
+namespace parallel {
+
+/**
+ * @brief The reactor class
+ * Owns an epoll descriptor and a single polling thread. Ready events are handed to the
+ * thread_pool in batches, one pool task per batch.
+ * Every descriptor is armed with EPOLLONESHOT, so its callback never runs twice at once;
+ * the reactor re-arms it after the callback returns.
+ * The pool has to outlive the reactor.
+ */
+class reactor
+{
+public:
+   using tCallback = std::function<void(int fd, std::uint32_t events)>;
+
+   enum trigger
+   {
+      level,
+      edge
+   };
+
+private:
+   struct handler
+   {
+      std::uint32_t generation;
+      std::uint32_t events;
+      tCallback callback;
+   };
+
+   using tHandler = std::shared_ptr<handler>;
+
+   thread_pool& _pool;
+   std::size_t const _batch;
+   int _epfd {-1};
+   int _wakefd {-1};
+
+   std::mutex _mut;
+   std::unordered_map<int, tHandler> _handlers;
+   std::uint32_t _generation {0};
+
+   std::condition_variable _idle;
+   std::size_t _in_flight {0};
+
+   std::atomic_bool _done {false};
+   std::vector<raii::join_thread> _loop;
+
+   static void check(int result, char const* what)
+   {
+      if (result < 0)
+         throw std::system_error(errno, std::system_category(), what);
+   }
+
+   static std::uint64_t pack(int fd, std::uint32_t generation) noexcept
+   {
+      return (std::uint64_t{generation} << 32) | static_cast<std::uint32_t>(fd);
+   }
+
+   void loop()
+   {
+      std::vector<epoll_event> ready(std::max<std::size_t>(_batch * 4, 64));
+      while (!_done)
+      {
+         auto count = ::epoll_wait(_epfd, ready.data(), static_cast<int>(ready.size()), -1);
+         if (count < 0 && errno == EINTR)
+            continue;
+         // anything else means the epoll fd is unusable, the exception ends the process
+         check(count, "epoll_wait");
+
+         auto first = ready.begin();
+         auto last = first + count;
+         last = std::remove_if(first, last, [](epoll_event const& e){ return e.data.u64 == 0; });
+
+         for (auto it = first; it != last; it += std::min<std::ptrdiff_t>(_batch, last - it))
+         {
+            std::vector<epoll_event> batch(it, it + std::min<std::ptrdiff_t>(_batch, last - it));
+            {
+               std::lock_guard<std::mutex> lk(_mut);
+               ++_in_flight;
+            }
+            _pool.submit([this, batch]{ dispatch(batch); });
+         }
+      }
+   }
+
+   void dispatch(std::vector<epoll_event> const& batch)
+   {
+      for (auto const& e : batch)
+      {
+         auto fd = static_cast<int>(e.data.u64 & 0xffffffff);
+         auto generation = static_cast<std::uint32_t>(e.data.u64 >> 32);
+
+         tHandler h;
+         {
+            std::lock_guard<std::mutex> lk(_mut);
+            auto found = _handlers.find(fd);
+            if (found == _handlers.end() || found->second->generation != generation)
+               continue;
+            h = found->second;
+         }
+
+         h->callback(fd, e.events);
+         rearm(fd, *h);
+      }
+
+      std::lock_guard<std::mutex> lk(_mut);
+      if (--_in_flight == 0)
+         _idle.notify_all();
+   }
+
+   void rearm(int fd, handler const& h)
+   {
+      std::lock_guard<std::mutex> lk(_mut);
+      auto found = _handlers.find(fd);
+      if (found == _handlers.end() || found->second->generation != h.generation)
+         return;
+
+      epoll_event e {};
+      e.events = h.events;
+      e.data.u64 = pack(fd, h.generation);
+      ::epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &e);
+   }
+
+   void close_fds() noexcept
+   {
+      if (_wakefd >= 0)
+         ::close(_wakefd);
+      if (_epfd >= 0)
+         ::close(_epfd);
+   }
+
+public:
+   explicit reactor(thread_pool& pool, std::size_t batch = 16)
+   : _pool(pool), _batch(std::max<std::size_t>(batch, 1))
+   {
+      try
+      {
+         _epfd = ::epoll_create1(EPOLL_CLOEXEC);
+         check(_epfd, "epoll_create1");
+         _wakefd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+         check(_wakefd, "eventfd");
+
+         epoll_event e {};
+         e.events = EPOLLIN;
+         e.data.u64 = 0;
+         check(::epoll_ctl(_epfd, EPOLL_CTL_ADD, _wakefd, &e), "epoll_ctl");
+
+         _loop.emplace_back(&reactor::loop, this);
+      }
+      catch (...)
+      {
+         close_fds();
+         throw;
+      }
+   }
+
+   ~reactor()
+   {
+      _done = true;
+      std::uint64_t one = 1;
+      auto written = ::write(_wakefd, &one, sizeof(one));
+      static_cast<void>(written);
+      _loop.clear();
+
+      {
+         std::unique_lock<std::mutex> lk(_mut);
+         _idle.wait(lk, [this]{ return _in_flight == 0; });
+      }
+      close_fds();
+   }
+
+   reactor(reactor const&) = delete;
+   reactor& operator=(reactor const&) = delete;
+
+   // events is an EPOLLIN/EPOLLOUT/... mask; the callback runs on a pool worker
+   void add(int fd, std::uint32_t events, tCallback callback, trigger t = level)
+   {
+      std::lock_guard<std::mutex> lk(_mut);
+      if (++_generation == 0)
+         ++_generation;
+
+      auto h = std::make_shared<handler>();
+      h->generation = _generation;
+      h->events = events | EPOLLONESHOT | (t == edge ? EPOLLET : 0u);
+      h->callback = std::move(callback);
+
+      epoll_event e {};
+      e.events = h->events;
+      e.data.u64 = pack(fd, h->generation);
+      check(::epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &e), "epoll_ctl");
+      _handlers[fd] = std::move(h);
+   }
+
+   // A callback already running for fd completes, but is not re-armed.
+   void remove(int fd)
+   {
+      std::lock_guard<std::mutex> lk(_mut);
+      if (_handlers.erase(fd))
+         ::epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, nullptr);
+   }
+};
+
+}
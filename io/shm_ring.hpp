@@ -0,0 +1,459 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "sync/futex.hpp"
+
+/**
+ * Example
+ *
+ * // feed handler
+ * auto ring = parallel::shm_ring<tick>::create("/feed", 1 << 16);
+ * ring.attach_producer();
+ * ring.push(t);
+ *
+ * // strategy engine
+ * auto ring = parallel::shm_ring<tick>::open("/feed");
+ * tick t;
+ * while (ring.pop(t) == parallel::shm_status::ok)
+ *    ...
+ */
+
+namespace parallel {
+
+enum class shm_status
+{
+   ok,
+   timeout,
+   producer_dead
+};
+
+/**
+ * @brief The shm_ring class
+ * Fixed capacity ring of trivially copyable T in a POSIX shared memory segment, for many
+ * producer processes (or threads) and one consumer. Slots carry sequence numbers
+ * (Vyukov's bounded queue), with MultiProducer = false producers skip the CAS.
+ * The segment holds only offsets, counters and the slots, so every process may map it at
+ * a different address. Its header records a magic, a layout version, the slot size and
+ * the capacity; open() refuses a segment that does not match.
+ * Blocked pushes and pops sleep on process-shared futexes.
+ * Producers register their pid with attach_producer() and clear it on destruction; a pid
+ * left behind by a process that has exited (a zombie included) is released and reported
+ * once, as shm_status::producer_dead from a waiting pop, after which the consumer goes on
+ * serving the others. Liveness comes from /proc/<pid>/stat, so a pid reused by an
+ * unrelated process hides the crash. A producer killed in the middle of a push leaves
+ * its slot unpublished, the ring has to be recreated then.
+ */
+template <typename T, bool MultiProducer = true>
+class shm_ring
+{
+   static_assert(std::is_trivially_copyable<T>::value, "shm_ring: T must be trivially copyable");
+   static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+                 "shm_ring: atomics in shared memory must be lock-free");
+
+public:
+   static constexpr std::uint32_t magic = 0x51524c50;   // "PLRQ"
+   static constexpr std::uint32_t version = 1;
+   static constexpr std::size_t max_producers = 32;
+
+private:
+   struct header
+   {
+      std::uint32_t magic;
+      std::uint32_t version;
+      std::uint32_t slot_size;
+      std::uint32_t multi_producer;
+      std::uint64_t capacity;
+      std::atomic<std::uint32_t> ready;     // set last by create()
+
+      alignas(64) std::atomic<std::uint64_t> tail;     // next position to claim
+      alignas(64) std::atomic<std::uint64_t> head;     // next position to consume
+      alignas(64) std::atomic<int> pushed;             // futex words for sleeping
+      alignas(64) std::atomic<int> popped;             // pops and pushes
+      alignas(64) std::atomic<std::int32_t> producers[max_producers];
+   };
+
+   struct slot
+   {
+      std::atomic<std::uint64_t> sequence;
+      T value;
+   };
+
+   static constexpr std::size_t slots_offset = (sizeof(header) + 63) / 64 * 64;
+   // how often a waiting pop looks for dead producers
+   static std::chrono::nanoseconds liveness_period() noexcept
+   {
+      return std::chrono::milliseconds(100);
+   }
+
+   std::string _name;
+   void* _base {MAP_FAILED};
+   std::size_t _size {0};
+   std::int32_t _producer_slot {-1};
+   std::vector<pid_t> _dead;
+
+   static void check(int result, char const* what)
+   {
+      if (result < 0)
+         throw std::system_error(errno, std::system_category(), what);
+   }
+
+   static std::size_t segment_size(std::uint64_t capacity) noexcept
+   {
+      return slots_offset + static_cast<std::size_t>(capacity) * sizeof(slot);
+   }
+
+   header& head() const noexcept
+   {
+      return *static_cast<header*>(_base);
+   }
+
+   slot& at(std::uint64_t position) const noexcept
+   {
+      auto slots = reinterpret_cast<slot*>(static_cast<char*>(_base) + slots_offset);
+      return slots[position & (head().capacity - 1)];
+   }
+
+   void map(int fd, std::size_t size)
+   {
+      _base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      auto error = errno;
+      ::close(fd);
+      if (_base == MAP_FAILED)
+         throw std::system_error(error, std::system_category(), "mmap");
+      _size = size;
+   }
+
+   static timespec to_timespec(std::chrono::nanoseconds d) noexcept
+   {
+      timespec ts;
+      ts.tv_sec = static_cast<time_t>(d.count() / 1000000000);
+      ts.tv_nsec = static_cast<long>(d.count() % 1000000000);
+      return ts;
+   }
+
+   // A futex word holds a wake-up count shifted left by one and a "somebody sleeps" bit.
+   // The sleeper sets the bit before its last look at the ring and the waker clears it
+   // when it wakes, so only the first push or pop after a sleeper arrived pays for the
+   // syscall. The fences make sure that either the waker sees the bit or ready() sees
+   // the waker's update.
+   template <typename Ready>
+   static void sleep_on(std::atomic<int>& word, std::chrono::nanoseconds timeout, Ready ready) noexcept
+   {
+      auto seen = word.load();
+      while (!(seen & 1) && !word.compare_exchange_weak(seen, seen | 1))
+         ;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!ready())
+      {
+         auto ts = to_timespec(timeout);
+         detail::futex_wait_shared(word, seen | 1, &ts);
+      }
+   }
+
+   static void wake(std::atomic<int>& word) noexcept
+   {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      auto current = word.load(std::memory_order_relaxed);
+      if ((current & 1) && word.compare_exchange_strong(current, (current + 2) & ~1))
+         detail::futex_wake_shared(word);
+   }
+
+   bool readable() const noexcept
+   {
+      auto position = head().head.load(std::memory_order_relaxed);
+      return at(position).sequence.load(std::memory_order_acquire) == position + 1;
+   }
+
+   bool writable() const noexcept
+   {
+      auto position = head().tail.load(std::memory_order_relaxed);
+      return at(position).sequence.load(std::memory_order_acquire) == position;
+   }
+
+   explicit shm_ring(std::string name) : _name(std::move(name))
+   {   }
+
+   // kill(pid, 0) succeeds for a zombie, so the state is read from /proc
+   static bool alive(pid_t pid)
+   {
+      auto path = "/proc/" + std::to_string(pid) + "/stat";
+      auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+         return errno == ENOENT ? false : !(::kill(pid, 0) < 0 && errno == ESRCH);
+
+      char buf[512];
+      auto n = ::read(fd, buf, sizeof(buf) - 1);
+      ::close(fd);
+      if (n <= 0)
+         return false;
+      buf[n] = '\0';
+
+      // "pid (comm) state ...", comm may contain ')' itself
+      auto end = std::strrchr(buf, ')');
+      if (!end || end[1] != ' ')
+         return true;
+      return end[2] != 'Z' && end[2] != 'X' && end[2] != 'x';
+   }
+
+public:
+   shm_ring(shm_ring&& other) noexcept
+   : _name(std::move(other._name))
+   , _base(std::exchange(other._base, MAP_FAILED))
+   , _size(other._size)
+   , _producer_slot(std::exchange(other._producer_slot, -1))
+   , _dead(std::move(other._dead))
+   {   }
+
+   shm_ring& operator=(shm_ring&&) = delete;
+   shm_ring(shm_ring const&) = delete;
+
+   ~shm_ring()
+   {
+      if (_base == MAP_FAILED)
+         return;
+
+      if (_producer_slot >= 0)
+         head().producers[_producer_slot].store(0);
+      ::munmap(_base, _size);
+   }
+
+   // Creates the segment; fails if a segment of that name exists.
+   // capacity is rounded up to a power of two.
+   static shm_ring create(std::string const& name, std::size_t capacity)
+   {
+      std::uint64_t rounded = 1;
+      while (rounded < capacity)
+         rounded <<= 1;
+
+      auto fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+      check(fd, "shm_open");
+      auto size = segment_size(rounded);
+      if (::ftruncate(fd, static_cast<off_t>(size)) < 0)
+      {
+         auto error = errno;
+         ::close(fd);
+         ::shm_unlink(name.c_str());
+         throw std::system_error(error, std::system_category(), "ftruncate");
+      }
+
+      shm_ring ring(name);
+      ring.map(fd, size);
+
+      // the pages are zero, which is a valid state for every atomic in there
+      auto& h = ring.head();
+      h.magic = magic;
+      h.version = version;
+      h.slot_size = sizeof(slot);
+      h.multi_producer = MultiProducer;
+      h.capacity = rounded;
+      for (std::uint64_t i = 0; i < rounded; ++i)
+         ring.at(i).sequence.store(i, std::memory_order_relaxed);
+      h.ready.store(1, std::memory_order_release);
+      return ring;
+   }
+
+   static shm_ring open(std::string const& name)
+   {
+      auto fd = ::shm_open(name.c_str(), O_RDWR, 0600);
+      check(fd, "shm_open");
+
+      struct stat st;
+      if (::fstat(fd, &st) < 0 || static_cast<std::size_t>(st.st_size) < slots_offset)
+      {
+         ::close(fd);
+         throw std::runtime_error("shm_ring: " + name + " is not initialized");
+      }
+
+      shm_ring ring(name);
+      ring.map(fd, static_cast<std::size_t>(st.st_size));
+
+      auto& h = ring.head();
+      if (h.ready.load(std::memory_order_acquire) != 1 || h.magic != magic)
+         throw std::runtime_error("shm_ring: " + name + " is not a ring segment");
+      if (h.version != version || h.slot_size != sizeof(slot) || h.multi_producer != MultiProducer
+          || segment_size(h.capacity) != ring._size)
+         throw std::runtime_error("shm_ring: " + name + " has an incompatible layout");
+      return ring;
+   }
+
+   static void unlink(std::string const& name) noexcept
+   {
+      ::shm_unlink(name.c_str());
+   }
+
+   std::size_t capacity() const noexcept
+   {
+      return static_cast<std::size_t>(head().capacity);
+   }
+
+   // Registers the calling process as a producer, for dead producer detection.
+   void attach_producer()
+   {
+      if (_producer_slot >= 0)
+         return;
+
+      auto& producers = head().producers;
+      for (std::size_t i = 0; i < max_producers; ++i)
+      {
+         std::int32_t expected = 0;
+         if (producers[i].compare_exchange_strong(expected, static_cast<std::int32_t>(::getpid())))
+         {
+            _producer_slot = static_cast<std::int32_t>(i);
+            return;
+         }
+      }
+      throw std::runtime_error("shm_ring: too many producers");
+   }
+
+   // Registered producers whose process is gone. Their slots are released, so each one
+   // is reported once.
+   std::vector<pid_t> dead_producers()
+   {
+      std::vector<pid_t> dead;
+      for (auto& producer : head().producers)
+      {
+         auto pid = producer.load();
+         if (pid != 0 && !alive(static_cast<pid_t>(pid)) && producer.compare_exchange_strong(pid, 0))
+            dead.push_back(static_cast<pid_t>(pid));
+      }
+      return dead;
+   }
+
+   // The producers behind the last shm_status::producer_dead.
+   std::vector<pid_t> const& dead() const noexcept
+   {
+      return _dead;
+   }
+
+   bool try_push(T const& value) noexcept
+   {
+      auto& h = head();
+      auto position = h.tail.load(std::memory_order_relaxed);
+      while (true)
+      {
+         auto& s = at(position);
+         auto sequence = s.sequence.load(std::memory_order_acquire);
+         auto diff = static_cast<std::int64_t>(sequence - position);
+         if (diff < 0)
+            return false;   // full
+
+         if (diff > 0)
+            position = h.tail.load(std::memory_order_relaxed);
+         else if (!MultiProducer)
+         {
+            h.tail.store(position + 1, std::memory_order_relaxed);
+            break;
+         }
+         else if (h.tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            break;
+      }
+
+      auto& s = at(position);
+      s.value = value;
+      s.sequence.store(position + 1, std::memory_order_release);
+      wake(h.pushed);
+      return true;
+   }
+
+   // Waits while the ring is full.
+   void push(T const& value) noexcept
+   {
+      auto& h = head();
+      while (!try_push(value))
+         sleep_on(h.popped, liveness_period(), [this]{ return writable(); });
+   }
+
+   // Single consumer.
+   bool try_pop(T& value) noexcept
+   {
+      auto& h = head();
+      auto position = h.head.load(std::memory_order_relaxed);
+      auto& s = at(position);
+      if (s.sequence.load(std::memory_order_acquire) != position + 1)
+         return false;
+
+      value = s.value;
+      s.sequence.store(position + h.capacity, std::memory_order_release);
+      h.head.store(position + 1, std::memory_order_relaxed);
+      wake(h.popped);
+      return true;
+   }
+
+   // Waits up to timeout; checks for dead producers while waiting.
+   template <typename Rep, typename Period>
+   shm_status pop_for(T& value, std::chrono::duration<Rep, Period> timeout)
+   {
+      auto& h = head();
+      auto const deadline = std::chrono::steady_clock::now() + timeout;
+      while (true)
+      {
+         if (try_pop(value))
+            return shm_status::ok;
+
+         auto now = std::chrono::steady_clock::now();
+         if (now >= deadline)
+            return shm_status::timeout;
+         auto dead = dead_producers();
+         if (!dead.empty())
+         {
+            _dead = std::move(dead);
+            return shm_status::producer_dead;
+         }
+
+         auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now);
+         sleep_on(h.pushed, std::min(left, liveness_period()), [this]{ return readable(); });
+      }
+   }
+
+   // Waits until a value arrives or a registered producer is found dead, see dead().
+   shm_status pop(T& value)
+   {
+      shm_status status;
+      while ((status = pop_for(value, std::chrono::hours(1))) == shm_status::timeout)
+         ;
+      return status;
+   }
+};
+
+}
@@ -0,0 +1,210 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "containers/queue.hpp"
+
+/**
+ * Example
+ *
+ * parallel::queue<order> orders;
+ * orders.spill_to(std::make_unique<parallel::spill_log>("/var/spool/engine"),
+ *                 {encode_order, decode_order});
+ */
+
+namespace parallel {
+
+/**
+ * @brief The spill_log class
+ * Append-only overflow storage on local disk. Batches of bytes are appended to segment
+ * files in one write each and read back, also a batch per read, in the order they were
+ * written. A segment is started once the previous one holds segment_bytes and is closed
+ * as soon as it is read through, which gives its space back to the file system.
+ * Segments are unlinked right after they are created: a crashed process leaves nothing
+ * behind in the directory, and nothing survives a restart either - this is relief for
+ * memory, not persistence, so there is no fsync.
+ * Not thread safe, the owner serializes access (parallel::queue holds its lock).
+ * Throws std::system_error: from the constructor if directory cannot be opened, from
+ * append and read on I/O errors, which leave the log as it was.
+ */
+class spill_log : public spill_storage
+{
+   struct segment
+   {
+      int fd;
+      std::uint64_t written;
+      std::uint64_t read;
+   };
+
+   std::string _directory;
+   std::uint64_t _segment_bytes;
+   std::deque<segment> _segments;
+   std::size_t _batches {0};
+   std::uint64_t _bytes {0};
+
+   static void check(bool ok, char const* what)
+   {
+      if (!ok)
+         throw std::system_error(errno, std::system_category(), what);
+   }
+
+   static void write_all(int fd, char const* data, std::size_t size, std::uint64_t offset)
+   {
+      while (size > 0)
+      {
+         auto n = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+         if (n < 0 && errno == EINTR)
+            continue;
+         check(n > 0, "spill_log: pwrite");
+         data += n;
+         size -= static_cast<std::size_t>(n);
+         offset += static_cast<std::uint64_t>(n);
+      }
+   }
+
+   static void read_all(int fd, char* data, std::size_t size, std::uint64_t offset)
+   {
+      while (size > 0)
+      {
+         auto n = ::pread(fd, data, size, static_cast<off_t>(offset));
+         if (n < 0 && errno == EINTR)
+            continue;
+         check(n > 0, "spill_log: pread");
+         data += n;
+         size -= static_cast<std::size_t>(n);
+         offset += static_cast<std::uint64_t>(n);
+      }
+   }
+
+   void open_segment()
+   {
+      std::vector<char> path(_directory.begin(), _directory.end());
+      static char const name[] = "/parallel-spill-XXXXXX";
+      path.insert(path.end(), name, name + sizeof(name));
+      auto fd = ::mkstemp(path.data());
+      check(fd >= 0, "spill_log: mkstemp");
+      ::unlink(path.data());
+      _segments.push_back({fd, 0, 0});
+   }
+
+   void close_front()
+   {
+      ::close(_segments.front().fd);
+      _segments.pop_front();
+   }
+
+public:
+   explicit spill_log(std::string directory, std::uint64_t segment_bytes = 64 << 20)
+      : _directory(std::move(directory)), _segment_bytes(segment_bytes)
+   {
+      auto fd = ::open(_directory.c_str(), O_RDONLY | O_DIRECTORY);
+      check(fd >= 0, "spill_log: open directory");
+      ::close(fd);
+   }
+
+   spill_log(spill_log const&) = delete;
+   spill_log& operator=(spill_log const&) = delete;
+
+   ~spill_log() override
+   {
+      while (!_segments.empty())
+         close_front();
+   }
+
+   void append(std::string const& batch) override
+   {
+      if (_segments.empty() || _segments.back().written >= _segment_bytes)
+         open_segment();
+
+      auto& s = _segments.back();
+      std::uint64_t size = batch.size();
+      char frame[sizeof(size)];
+      std::memcpy(frame, &size, sizeof(size));
+      write_all(s.fd, frame, sizeof(frame), s.written);
+      write_all(s.fd, batch.data(), batch.size(), s.written + sizeof(frame));
+      s.written += sizeof(frame) + size;
+      _bytes += sizeof(frame) + size;
+      ++_batches;
+   }
+
+   // Replaces batch with the oldest batch, returns false when the log is empty.
+   bool read(std::string& batch) override
+   {
+      if (_batches == 0)
+         return false;
+
+      auto& s = _segments.front();
+      std::uint64_t size;
+      read_all(s.fd, reinterpret_cast<char*>(&size), sizeof(size), s.read);
+      batch.resize(static_cast<std::size_t>(size));
+      read_all(s.fd, &batch[0], batch.size(), s.read + sizeof(size));
+      s.read += sizeof(size) + size;
+      --_batches;
+
+      // also drops the segment being written once the log is empty, so a burst does
+      // not keep its last file around
+      if (s.read == s.written)
+      {
+         _bytes -= s.written;
+         close_front();
+      }
+      return true;
+   }
+
+   bool empty() const noexcept
+   {
+      return _batches == 0;
+   }
+
+   std::size_t batches() const noexcept
+   {
+      return _batches;
+   }
+
+   // files currently open, each unlinked already
+   std::size_t segments() const noexcept
+   {
+      return _segments.size();
+   }
+
+   // disk space held by the open segments
+   std::uint64_t bytes() const noexcept
+   {
+      return _bytes;
+   }
+};
+
+}
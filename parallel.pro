@@ -4,7 +4,15 @@ TEMPLATE = app
 CONFIG += console c++14
 CONFIG -= app_bundle
 CONFIG -= qt
-LIBS += -pthread
+LIBS += -pthread -lrt
+
+# C++20 build with coroutine support: qmake CONFIG+=coroutines
+coroutines {
+    TARGET = parallel_coroutines
+    CONFIG -= c++14
+    CONFIG += c++2a
+    *g++*: QMAKE_CXXFLAGS += -fcoroutines
+}
 
 INCLUDEPATH += "/home/artem/Artem/googletest/googletest"
 INCLUDEPATH += "/home/artem/Artem/boost_1_72_0"
@@ -17,12 +25,38 @@ HEADERS += \
     utility/sequence.hpp \
     utility/thread_raii.hpp \
     containers/queue.hpp \
+    containers/channel.hpp \
+    containers/concurrent_hash_map.hpp \
+    containers/coroutine.hpp \
+    containers/disruptor.hpp \
+    containers/lock_free_stack.hpp \
+    containers/lru_cache.hpp \
     containers/thread_pool.hpp \
+    containers/timer_wheel.hpp \
+    containers/work_stealing_deque.hpp \
+    io/async_logger.hpp \
+    io/reactor.hpp \
+    io/shm_ring.hpp \
+    io/spill_log.hpp \
     raii/multi_lock.hpp \
+    sync/futex.hpp \
+    sync/latch.hpp \
+    sync/left_right.hpp \
+    sync/profiled_mutex.hpp \
+    sync/semaphore.hpp \
+    sync/seqlock.hpp \
+    sync/sharded_counter.hpp \
+    sync/shared_mutex.hpp \
+    sync/spin_lock.hpp \
     raii/scoped_thread.hpp \
     test/tst_parallel.hpp \
     assert.hpp \
     property.hpp \
     utility/not_null.hpp \
     utility/not_null.hpp \
-    utility/property.hpp
+    utility/arena.hpp \
+    utility/object_pool.hpp \
+    utility/property.hpp \
+    utility/stop_token.hpp \
+    utility/thread_specific.hpp \
+    utility/topology.hpp
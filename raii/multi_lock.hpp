@@ -25,8 +25,13 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <mutex>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 
 namespace parallel {
 namespace raii {
@@ -34,15 +39,31 @@ namespace raii {
  * @brief The lock_guards class
  * multi_lock is a mutexes wrapper that provides a convenient RAII-style mechanism for owning a few mutexes for the duration of a scoped block.
  * multi_lock use a deadlock avoidance algorithm to avoid deadlock.
+ * Mutexes wrapped with shared() are taken in shared mode (lock_shared/unlock_shared).
+ * make_locks(ordered, ...) locks in a global canonical order instead: by rank() if the
+ * lockable defines one, otherwise by address. Every thread then blocks directly on the
+ * next mutex without the try-lock/back-off rounds of std::lock, which pays off under
+ * heavy contention on many mutexes. It is deadlock-free only as long as every thread
+ * takes those mutexes in the same order, e.g. all through make_locks(ordered, ...).
+ * Mixed lockable types fall back to std::lock.
  * Example:
 
   // Code with multi_lock
    std::mutex m1;
    std::recursive_mutex m2;
+   std::shared_timed_mutex m3;
 
    void do_work()
    {
-      auto guards = make_locks(m1, m2);
+      auto guards = make_locks(m1, m2, shared(m3));
+      //do rest of work
+   }
+
+   std::mutex accounts[8];
+
+   void transfer(int from, int to, int fee)
+   {
+      auto guards = make_locks(ordered, accounts[from], accounts[to], accounts[fee]);
       //do rest of work
    }
 /////////////////////////////////////////////////////////////////////////
@@ -60,14 +81,77 @@ namespace raii {
    }
  */
 
+struct ordered_t
+{
+   explicit ordered_t() = default;
+};
+
+constexpr ordered_t ordered {};
+
+template <typename T>
+auto lock_rank(T const& lockable, int) -> decltype(static_cast<std::uintptr_t>(lockable.rank()))
+{
+   return static_cast<std::uintptr_t>(lockable.rank());
+}
+
+template <typename T>
+std::uintptr_t lock_rank(T const& lockable, long)
+{
+   return reinterpret_cast<std::uintptr_t>(&lockable);
+}
+
+template <typename T>
+std::uintptr_t lock_rank(T const& lockable)
+{
+   return lock_rank(lockable, 0);
+}
+
+/**
+ * @brief The shared_lockable class
+ * Presents the shared mode of a SharedMutex as a Lockable.
+ */
+template <typename T>
+class shared_lockable
+{
+   T& _mutex;
+public:
+   explicit shared_lockable(T& mutex) noexcept
+   : _mutex(mutex)
+   {   }
+
+   void lock() { _mutex.lock_shared(); }
+   bool try_lock() { return _mutex.try_lock_shared(); }
+   void unlock() { _mutex.unlock_shared(); }
+
+   std::uintptr_t rank() const { return lock_rank(_mutex); }
+};
+
+template <typename T>
+shared_lockable<T> shared(T& mutex) noexcept
+{
+   return shared_lockable<T>(mutex);
+}
+
+template <typename T>
+struct is_lock_adapter : std::false_type {};
+
+template <typename T>
+struct is_lock_adapter<shared_lockable<T>> : std::true_type {};
+
+template <bool ...B>
+struct all_true : std::is_same<std::integer_sequence<bool, true, B...>, std::integer_sequence<bool, B..., true>> {};
 
 template <typename ...Args>
 class multi_lock
 {
+    // adapters are small handles and are kept by value, mutexes by reference
+    template <typename T>
+    using holder_t = std::conditional_t<is_lock_adapter<T>::value, T, T&>;
+
     template <typename T>
     class unlock_guard
     {
-       T& _mutex;
+       holder_t<T> _mutex;
     public:
        unlock_guard(T& mutex) noexcept
        : _mutex(mutex)
@@ -78,20 +162,77 @@ class multi_lock
        }
     };
 
-   std::tuple<unlock_guard<Args>...> _guards;
-public:
-   multi_lock(Args&... args) : _guards(std::tuple<unlock_guard<Args>...>(args...))
+   template <typename T>
+   static void lock_all(T& lockable)
    {
-      std::lock(args...);
+      lockable.lock();
+   }
+
+   template <typename T1, typename T2, typename ...Ts>
+   static void lock_all(T1& l1, T2& l2, Ts&... ls)
+   {
+      std::lock(l1, l2, ls...);
+   }
+
+   template <typename T, typename ...Ts>
+   static void lock_ordered(std::true_type, T& l, Ts&... ls)
+   {
+      std::array<T*, 1 + sizeof...(Ts)> order {{&l, &ls...}};
+      std::sort(order.begin(), order.end(), [](T const* a, T const* b){
+         return lock_rank(*a) < lock_rank(*b);
+      });
+
+      std::size_t locked = 0;
+      try
+      {
+         for (auto m : order)
+         {
+            m->lock();
+            ++locked;
+         }
+      }
+      catch(...)
+      {
+         while (locked != 0)
+            order[--locked]->unlock();
+         throw;
+      }
    }
+
+   template <typename ...Ts>
+   static void lock_ordered(std::false_type, Ts&... ls)
+   {
+      lock_all(ls...);
+   }
+
+   using first_type = std::tuple_element_t<0, std::tuple<Args...>>;
+   using same_types = std::is_same<std::tuple<first_type, Args...>, std::tuple<Args..., first_type>>;
+
+   // the mutexes are locked before the guards exist, a throwing lock leaves nothing to unlock
+   std::tuple<unlock_guard<Args>...> _guards;
+public:
+   multi_lock(Args&... args) : _guards((lock_all(args...), std::tuple<unlock_guard<Args>...>(args...)))
+   {   }
+
+   multi_lock(ordered_t, Args&... args) : _guards((lock_ordered(same_types{}, args...), std::tuple<unlock_guard<Args>...>(args...)))
+   {   }
 };
 
 template <typename ...Args>
-multi_lock<Args...> make_locks(Args&... args)
+multi_lock<std::remove_reference_t<Args>...> make_locks(Args&&... args)
 {
-   return multi_lock<Args...>(args...);
+   static_assert(all_true<(std::is_lvalue_reference<Args>::value || is_lock_adapter<std::decay_t<Args>>::value)...>::value,
+                 "make_locks: mutexes must be passed as lvalues");
+   return multi_lock<std::remove_reference_t<Args>...>(args...);
 }
 
-}
+template <typename ...Args>
+multi_lock<std::remove_reference_t<Args>...> make_locks(ordered_t tag, Args&&... args)
+{
+   static_assert(all_true<(std::is_lvalue_reference<Args>::value || is_lock_adapter<std::decay_t<Args>>::value)...>::value,
+                 "make_locks: mutexes must be passed as lvalues");
+   return multi_lock<std::remove_reference_t<Args>...>(tag, args...);
 }
 
+}
+}
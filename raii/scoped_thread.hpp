@@ -25,11 +25,41 @@
 
 #pragma once
 
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
 #include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "utility/property.hpp"
+#include "utility/stop_token.hpp"
 
 /**
  * Example
  * raii:join_thread ( []{ do work.. } );
+ *
+ * raii::thread_attributes attr;
+ * attr.name = "feed";
+ * attr.cpus = {3};
+ * attr.stack_size = 64 * 1024;
+ * attr.fifo_priority = 50;   // falls back to attr.nice when not permitted
+ * raii:join_thread ( attr, []{ do work.. } );
+ *
+ * A callable taking a stop_token first gets one from the thread's stop_source;
+ * join_thread requests the stop before joining, like std::jthread.
+ * raii:join_thread ( [&q]( parallel::stop_token token ){ while ( q.wait_and_pop( item, token ) ) ... } );
  */
 
 namespace parallel {
@@ -41,6 +71,204 @@ enum class thread_exec
    detach
 };
 
+/**
+ * @brief The thread_attributes struct
+ * Attributes for a scoped_thread. The name, affinity and scheduling are applied by the
+ * new thread itself before it runs the callable; failures there (e.g. SCHED_FIFO or a
+ * negative nice without CAP_SYS_NICE) are ignored so an unprivileged process still runs.
+ * A stack size needs the thread to be created with pthread_create.
+ */
+struct thread_attributes
+{
+   std::string name;              // at most 15 characters are kept
+   std::vector<int> cpus;         // affinity set, empty keeps the inherited one
+   std::size_t stack_size {0};    // 0 keeps the default
+   property<int> fifo_priority;   // SCHED_FIFO priority
+   property<int> nice;            // used if SCHED_FIFO is not requested or not permitted
+
+   void apply_to_current_thread() const noexcept
+   {
+      if (!name.empty())
+         ::pthread_setname_np(::pthread_self(), name.substr(0, 15).c_str());
+
+      if (!cpus.empty())
+      {
+         cpu_set_t set;
+         CPU_ZERO(&set);
+         for (auto cpu : cpus)
+            CPU_SET(cpu, &set);
+         ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+      }
+
+      if (fifo_priority)
+      {
+         sched_param param {};
+         param.sched_priority = fifo_priority.value();
+         if (::pthread_setschedparam(::pthread_self(), SCHED_FIFO, &param) == 0)
+            return;
+      }
+
+      if (nice)
+         ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), nice.value());
+   }
+};
+
+namespace detail {
+
+// joinable pthread owner for the threads std::thread cannot create
+class native_thread
+{
+   pthread_t _h {};
+   bool _joinable {false};
+
+   template <typename Task>
+   static void* run(void* arg) noexcept
+   {
+      std::unique_ptr<Task> task(static_cast<Task*>(arg));
+      try
+      {
+         (*task)();
+      }
+      catch (...)
+      {
+         std::terminate();
+      }
+      return nullptr;
+   }
+
+public:
+   native_thread() = default;
+
+   // the new thread owns the task and destroys it after running it
+   template <typename Task>
+   native_thread(std::size_t stack_size, std::unique_ptr<Task> task)
+   {
+      struct attr_guard
+      {
+         pthread_attr_t attr;
+         attr_guard() { ::pthread_attr_init(&attr); }
+         ~attr_guard() { ::pthread_attr_destroy(&attr); }
+      } guard;
+      auto& attr = guard.attr;
+
+      if (stack_size != 0)
+      {
+         auto const page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+         stack_size = std::max<std::size_t>(stack_size, PTHREAD_STACK_MIN);
+         stack_size = (stack_size + page - 1) / page * page;
+         if (auto error = ::pthread_attr_setstacksize(&attr, stack_size))
+            throw std::system_error(error, std::system_category(), "pthread_attr_setstacksize");
+      }
+
+      if (auto error = ::pthread_create(&_h, &attr, &native_thread::run<Task>, task.get()))
+         throw std::system_error(error, std::system_category(), "pthread_create");
+      task.release();
+      _joinable = true;
+   }
+
+   native_thread(native_thread&& other) noexcept
+   : _h(other._h), _joinable(std::exchange(other._joinable, false))
+   {   }
+
+   native_thread& operator=(native_thread&& other) noexcept
+   {
+      if (_joinable)
+         std::terminate();
+      _h = other._h;
+      _joinable = std::exchange(other._joinable, false);
+      return *this;
+   }
+
+   ~native_thread()
+   {
+      if (_joinable)
+         std::terminate();
+   }
+
+   bool joinable() const noexcept { return _joinable; }
+   pthread_t native_handle() const noexcept { return _h; }
+
+   void join()
+   {
+      ::pthread_join(_h, nullptr);
+      _joinable = false;
+   }
+
+   void detach()
+   {
+      ::pthread_detach(_h);
+      _joinable = false;
+   }
+};
+
+template <typename Func, typename ...Args>
+class takes_stop_token
+{
+   template <typename F>
+   static auto test(int) -> decltype(std::declval<F>()(std::declval<stop_token>(), std::declval<Args>()...),
+                                     std::true_type{});
+   template <typename>
+   static std::false_type test(...);
+
+public:
+   static constexpr bool value = decltype(test<Func>(0))::value;
+};
+
+template <typename Func, typename ...Args>
+using takes_stop_token_t = std::integral_constant<bool, takes_stop_token<Func, Args...>::value>;
+
+template <typename Func, typename ...Args>
+std::thread start_thread(stop_token token, std::true_type, Func&& f, Args&&... args)
+{
+   return std::thread(std::forward<Func>(f), std::move(token), std::forward<Args>(args)...);
+}
+
+template <typename Func, typename ...Args>
+std::thread start_thread(stop_token, std::false_type, Func&& f, Args&&... args)
+{
+   return std::thread(std::forward<Func>(f), std::forward<Args>(args)...);
+}
+
+// What a native_thread runs: decayed copies of the callable and its arguments, which are
+// moved into the call as std::thread does, so move-only ones work and arrive as rvalues.
+template <typename Func, typename ...Args>
+struct attributed_task
+{
+   thread_attributes attr;
+   Func f;
+   std::tuple<Args...> args;
+
+   template <std::size_t ...I>
+   void invoke(std::index_sequence<I...>)
+   {
+      std::move(f)(std::get<I>(std::move(args))...);
+   }
+
+   void operator()()
+   {
+      attr.apply_to_current_thread();
+      invoke(std::index_sequence_for<Args...>{});
+   }
+};
+
+template <typename Func, typename ...Args>
+auto make_task(thread_attributes attr, stop_token token, std::true_type, Func&& f, Args&&... args)
+{
+   using task = attributed_task<std::decay_t<Func>, stop_token, std::decay_t<Args>...>;
+   return std::unique_ptr<task>(new task{ std::move(attr), std::forward<Func>(f),
+                                          std::tuple<stop_token, std::decay_t<Args>...>(std::move(token), std::forward<Args>(args)...) });
+}
+
+template <typename Func, typename ...Args>
+auto make_task(thread_attributes attr, stop_token, std::false_type, Func&& f, Args&&... args)
+{
+   using task = attributed_task<std::decay_t<Func>, std::decay_t<Args>...>;
+   return std::unique_ptr<task>(new task{ std::move(attr), std::forward<Func>(f),
+                                          std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...) });
+}
+
+}
+
 template <thread_exec d_action> class scoped_thread;
 
 using join_thread = scoped_thread<thread_exec::join>;
@@ -49,17 +277,29 @@ using detach_thread = scoped_thread<thread_exec::detach>;
 template <thread_exec>
 class scoped_thread
 {
+   stop_source _stop;
    std::thread _t;
+   detail::native_thread _native;
 
 public:
-   template <typename Func, typename ...Args>
+   template <typename Func, typename ...Args,
+             typename = std::enable_if_t<!std::is_same<std::decay_t<Func>, thread_attributes>::value>>
    scoped_thread( Func&& f, Args... args )
-   : _t( std::forward<Func>( f ), std::forward<Args>( args)... )
+   : _t( detail::start_thread( _stop.get_token(), detail::takes_stop_token_t<Func, Args...>{},
+                               std::forward<Func>( f ), std::forward<Args>( args)... ) )
+   {   }
+
+   // Threads with attributes are created with pthread_create, get() is not joinable for them.
+   template <typename Func, typename ...Args>
+   scoped_thread( thread_attributes attr, Func&& f, Args... args )
+   : _native( attr.stack_size,
+              detail::make_task( attr, _stop.get_token(), detail::takes_stop_token_t<Func, Args...>{},
+                                 std::forward<Func>( f ), std::move( args )... ) )
    {   }
 
    ~scoped_thread()
    {
-      if ( _t.joinable() )
+      if ( _t.joinable() || _native.joinable() )
          join_or_detach();
    }
 
@@ -68,20 +308,36 @@ public:
 
    std::thread& get() { return _t; }
 
+   stop_source get_stop_source() const noexcept { return _stop; }
+   stop_token get_stop_token() const noexcept { return _stop.get_token(); }
+   bool request_stop() { return _stop.request_stop(); }
+
+   pthread_t native_handle()
+   {
+      return _native.joinable() ? _native.native_handle() : _t.native_handle();
+   }
+
 private:
    void join_or_detach();
 };
 
 template<>
-void scoped_thread<thread_exec::join>::join_or_detach()
+inline void scoped_thread<thread_exec::join>::join_or_detach()
 {
-   _t.join();
+   _stop.request_stop();
+   if ( _native.joinable() )
+      _native.join();
+   else
+      _t.join();
 }
 
 template<>
-void scoped_thread<thread_exec::detach>::join_or_detach()
+inline void scoped_thread<thread_exec::detach>::join_or_detach()
 {
-   _t.detach();
+   if ( _native.joinable() )
+      _native.detach();
+   else
+      _t.detach();
 }
 
 }
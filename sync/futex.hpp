@@ -0,0 +1,95 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <climits>
+#include <ctime>
+#include "spin_lock.hpp"
+
+namespace parallel {
+namespace detail {
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex word must be a plain int");
+
+// Sleeps while word == expected; returns on wake-up, signal or if the value differs.
+inline void futex_wait(std::atomic<int>& word, int expected) noexcept
+{
+   ::syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<int>& word, int count = INT_MAX) noexcept
+{
+   ::syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
+// Variants for a word in memory shared between processes (MAP_SHARED); timeout is
+// relative, nullptr waits without one.
+inline void futex_wait_shared(std::atomic<int>& word, int expected, timespec const* timeout = nullptr) noexcept
+{
+   ::syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAIT, expected, timeout, nullptr, 0);
+}
+
+inline void futex_wake_shared(std::atomic<int>& word, int count = INT_MAX) noexcept
+{
+   ::syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAKE, count, nullptr, nullptr, 0);
+}
+
+/**
+ * Waits until word != value: spins for a short while, then sleeps on the futex.
+ * Sleepers are counted in 'sleepers', so the waking side can skip the syscall
+ * while nobody sleeps. Both sides use seq_cst, so either the waker sees the
+ * sleeper or the futex sees the new value.
+ */
+inline void spin_then_wait(std::atomic<int>& word, int value, std::atomic<int>& sleepers) noexcept
+{
+   for (int i = 0; i < 128; ++i)
+   {
+      if (word.load(std::memory_order_acquire) != value)
+         return;
+      cpu_relax();
+   }
+
+   while (word.load(std::memory_order_acquire) == value)
+   {
+      sleepers.fetch_add(1);
+      futex_wait(word, value);
+      sleepers.fetch_sub(1, std::memory_order_relaxed);
+   }
+}
+
+inline void wake_sleepers(std::atomic<int>& word, std::atomic<int> const& sleepers, int count = INT_MAX) noexcept
+{
+   if (sleepers.load() != 0)
+      futex_wake(word, count);
+}
+
+}
+}
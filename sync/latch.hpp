@@ -0,0 +1,134 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include "futex.hpp"
+
+/**
+ * Example
+ *
+ * parallel::barrier<std::function<void()>> phase(workers, []{ swap_buffers(); });
+ *
+ * // in every worker
+ * for (;;)
+ * {
+ *    compute_step();
+ *    phase.arrive_and_wait();   // the last one to arrive runs swap_buffers()
+ * }
+ */
+
+namespace parallel {
+
+/**
+ * @brief The latch class
+ * Single-use countdown, waiters spin briefly and then sleep on a futex.
+ */
+class latch
+{
+   mutable std::atomic<int> _count;
+   mutable std::atomic<int> _sleepers {0};
+
+public:
+   explicit latch(int count) : _count(count)
+   {   }
+
+   latch(latch const&) = delete;
+   latch& operator=(latch const&) = delete;
+
+   void count_down(int n = 1) noexcept
+   {
+      if (_count.fetch_sub(n) == n)
+         detail::wake_sleepers(_count, _sleepers);
+   }
+
+   bool try_wait() const noexcept
+   {
+      return _count.load(std::memory_order_acquire) == 0;
+   }
+
+   void wait() const noexcept
+   {
+      for (auto c = _count.load(std::memory_order_acquire); c != 0; c = _count.load(std::memory_order_acquire))
+         detail::spin_then_wait(_count, c, _sleepers);
+   }
+
+   void arrive_and_wait(int n = 1) noexcept
+   {
+      count_down(n);
+      wait();
+   }
+};
+
+struct no_completion
+{
+   void operator()() const noexcept {}
+};
+
+/**
+ * @brief The barrier class
+ * Reusable barrier for a fixed number of threads. The last thread to arrive runs the
+ * completion function and opens the next phase; the others spin briefly and then sleep
+ * on the phase counter, no mutex is involved.
+ */
+template <typename Completion = no_completion>
+class barrier
+{
+   int const _expected;
+   std::atomic<int> _arrived {0};
+   std::atomic<int> _phase {0};
+   std::atomic<int> _sleepers {0};
+   Completion _completion;
+
+public:
+   explicit barrier(int expected, Completion completion = Completion())
+   : _expected(expected), _completion(std::move(completion))
+   {   }
+
+   barrier(barrier const&) = delete;
+   barrier& operator=(barrier const&) = delete;
+
+   void arrive_and_wait()
+   {
+      auto const phase = _phase.load(std::memory_order_acquire);
+      if (_arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == _expected)
+      {
+         _completion();
+         _arrived.store(0, std::memory_order_relaxed);
+         // the phase wraps, so it is counted unsigned; only the futex word is an int
+         auto const next = static_cast<std::uint32_t>(phase) + 1;
+         _phase.store(static_cast<int>(next));
+         detail::wake_sleepers(_phase, _sleepers);
+         return;
+      }
+
+      detail::spin_then_wait(_phase, phase, _sleepers);
+   }
+};
+
+}
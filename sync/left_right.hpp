@@ -0,0 +1,122 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include "shared_mutex.hpp"
+
+/**
+ * Example
+ *
+ * parallel::left_right<std::map<std::string, route>> routes;
+ *
+ * auto r = routes.read([&name](auto const& table){ return table.at(name); });
+ * routes.modify([&](auto& table){ table[name] = next_hop; });
+ */
+
+namespace parallel {
+
+/**
+ * @brief The left_right class
+ * Double-buffered publication of an arbitrary T (Left-Right by Ramalhete and Correia).
+ * Readers are wait-free: they announce themselves in a read_indicator slot of their own
+ * and read whichever copy is current, never blocking on the writer.
+ * Writers are serialized; modify() applies the change to the idle copy, flips readers
+ * over to it, waits for the readers of the old copy to leave and applies the same
+ * change to it. The modifier is therefore run twice and must be deterministic.
+ */
+template <typename T>
+class left_right
+{
+   std::array<T, 2> _instances;
+   std::atomic<int> _current {0};
+   std::atomic<int> _version {0};
+   mutable std::array<read_indicator, 2> _readers;
+   std::mutex _writers;
+
+   void wait_for_readers(int version) const
+   {
+      while (!_readers[version].empty())
+         std::this_thread::yield();
+   }
+
+public:
+   template <typename ...Args>
+   explicit left_right(Args const&... args)
+   : _instances{{T(args...), T(args...)}}
+   {   }
+
+   left_right(left_right const&) = delete;
+   left_right& operator=(left_right const&) = delete;
+
+   template <typename F>
+   auto read(F&& f) const -> decltype(f(std::declval<T const&>()))
+   {
+      auto const version = _version.load();
+      _readers[version].arrive();
+
+      struct depart_guard
+      {
+         read_indicator& readers;
+         ~depart_guard() { readers.depart(); }
+      } guard {_readers[version]};
+
+      return f(_instances[_current.load()]);
+   }
+
+   template <typename F>
+   void modify(F f)
+   {
+      std::lock_guard<std::mutex> lk(_writers);
+
+      auto const current = _current.load(std::memory_order_relaxed);
+      f(_instances[1 - current]);
+      _current.store(1 - current);
+
+      auto const version = _version.load(std::memory_order_relaxed);
+      wait_for_readers(1 - version);
+      _version.store(1 - version);
+      wait_for_readers(version);
+
+      f(_instances[current]);
+   }
+
+   T load() const
+   {
+      return read([](T const& value){ return value; });
+   }
+
+   void store(T const& value)
+   {
+      modify([&value](T& instance){ instance = value; });
+   }
+};
+
+}
@@ -0,0 +1,360 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <execinfo.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * Example
+ *
+ * parallel::profiled_mutex<> m1 {"routes"};
+ * parallel::profiled_mutex<std::recursive_timed_mutex> m2 {"sessions"};
+ *
+ * auto guards = parallel::raii::make_locks(m1, m2);
+ * std::lock_guard<parallel::profiled_mutex<>> lk(m1);
+ *
+ * parallel::lock_registry::instance().dump(std::cerr, 5);
+ *
+ * Call sites are resolved with backtrace_symbols, link with -rdynamic to get names.
+ */
+
+namespace parallel {
+
+/**
+ * @brief The lock_histogram class
+ * Power-of-two buckets of nanoseconds: bucket i counts durations in [2^(i-1), 2^i).
+ */
+class lock_histogram
+{
+public:
+   static constexpr std::size_t buckets_count = 48;
+
+private:
+   std::array<std::atomic<std::uint64_t>, buckets_count> _buckets {};
+
+public:
+   void add(std::uint64_t ns) noexcept
+   {
+      std::size_t bucket = 0;
+      while (ns != 0 && bucket + 1 < buckets_count)
+      {
+         ns >>= 1;
+         ++bucket;
+      }
+      _buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+   }
+
+   std::uint64_t operator[](std::size_t bucket) const noexcept
+   {
+      return _buckets[bucket].load(std::memory_order_relaxed);
+   }
+
+   // upper bound (ns) of the bucket holding the given fraction of samples
+   std::uint64_t percentile(double fraction) const noexcept
+   {
+      std::uint64_t total = 0;
+      for (auto const& b : _buckets)
+         total += b.load(std::memory_order_relaxed);
+      if (total == 0)
+         return 0;
+
+      auto rank = static_cast<std::uint64_t>(fraction * static_cast<double>(total));
+      std::uint64_t seen = 0;
+      for (std::size_t i = 0; i < buckets_count; ++i)
+      {
+         seen += (*this)[i];
+         if (seen > rank)
+            return std::uint64_t{1} << i;
+      }
+      return std::uint64_t{1} << (buckets_count - 1);
+   }
+};
+
+/**
+ * @brief The lock_stats class
+ * Counters of one profiled mutex. Call sites are only captured for contended
+ * acquisitions, so the uncontended path stays a try_lock plus two clock reads.
+ */
+class lock_stats
+{
+public:
+   static constexpr int site_depth = 8;
+
+   struct call_site
+   {
+      std::vector<void*> frames;
+      std::uint64_t waits;
+      std::uint64_t wait_ns;
+   };
+
+   std::string const name;
+   std::atomic<std::uint64_t> acquisitions {0};
+   std::atomic<std::uint64_t> contended {0};
+   std::atomic<std::uint64_t> failed_try_locks {0};
+   std::atomic<std::uint64_t> wait_ns {0};
+   lock_histogram wait_time;
+   lock_histogram hold_time;
+
+private:
+   mutable std::mutex _sites_mut;
+   std::unordered_map<std::size_t, call_site> _sites;
+
+public:
+   explicit lock_stats(std::string n) : name(std::move(n))
+   {   }
+
+   void add_wait(std::uint64_t ns, void* const* frames, int depth)
+   {
+      contended.fetch_add(1, std::memory_order_relaxed);
+      wait_ns.fetch_add(ns, std::memory_order_relaxed);
+      wait_time.add(ns);
+
+      std::size_t key = 0;
+      for (int i = 0; i < depth; ++i)
+         key = key * 31 + std::hash<void*>()(frames[i]);
+
+      std::lock_guard<std::mutex> lk(_sites_mut);
+      auto& site = _sites[key];
+      if (site.frames.empty())
+         site.frames.assign(frames, frames + depth);
+      ++site.waits;
+      site.wait_ns += ns;
+   }
+
+   // call sites ordered by the time they spent waiting
+   std::vector<call_site> top_waiters(std::size_t count) const
+   {
+      std::vector<call_site> sites;
+      {
+         std::lock_guard<std::mutex> lk(_sites_mut);
+         for (auto const& s : _sites)
+            sites.push_back(s.second);
+      }
+      std::sort(sites.begin(), sites.end(), [](call_site const& l, call_site const& r){
+         return l.wait_ns > r.wait_ns;
+      });
+      if (sites.size() > count)
+         sites.resize(count);
+      return sites;
+   }
+};
+
+/**
+ * @brief The lock_registry class
+ * Process wide list of the live profiled mutexes.
+ */
+class lock_registry
+{
+   mutable std::mutex _mut;
+   std::unordered_set<std::shared_ptr<lock_stats>> _locks;
+
+public:
+   static lock_registry& instance()
+   {
+      static lock_registry registry;
+      return registry;
+   }
+
+   void add(std::shared_ptr<lock_stats> stats)
+   {
+      std::lock_guard<std::mutex> lk(_mut);
+      _locks.insert(std::move(stats));
+   }
+
+   void remove(std::shared_ptr<lock_stats> const& stats)
+   {
+      std::lock_guard<std::mutex> lk(_mut);
+      _locks.erase(stats);
+   }
+
+   // locks ordered by the total time threads spent waiting for them
+   std::vector<std::shared_ptr<lock_stats>> most_contended(std::size_t count) const
+   {
+      std::vector<std::shared_ptr<lock_stats>> locks;
+      {
+         std::lock_guard<std::mutex> lk(_mut);
+         locks.assign(_locks.begin(), _locks.end());
+      }
+      std::sort(locks.begin(), locks.end(), [](std::shared_ptr<lock_stats> const& l, std::shared_ptr<lock_stats> const& r){
+         return l->wait_ns.load() > r->wait_ns.load();
+      });
+      if (locks.size() > count)
+         locks.resize(count);
+      return locks;
+   }
+
+   void dump(std::ostream& out, std::size_t count = 10, std::size_t sites_count = 3) const
+   {
+      for (auto const& l : most_contended(count))
+      {
+         out << "lock '" << l->name << "': acquisitions " << l->acquisitions
+             << ", contended " << l->contended
+             << ", failed try_lock " << l->failed_try_locks
+             << ", wait total " << l->wait_ns / 1000 << "us"
+             << ", wait p50/p99 " << l->wait_time.percentile(0.5) << "/" << l->wait_time.percentile(0.99) << "ns"
+             << ", hold p50/p99 " << l->hold_time.percentile(0.5) << "/" << l->hold_time.percentile(0.99) << "ns\n";
+
+         for (auto const& site : l->top_waiters(sites_count))
+         {
+            out << "   " << site.waits << " waits, " << site.wait_ns / 1000 << "us at:\n";
+            std::unique_ptr<char*, decltype(&std::free)> symbols(
+               ::backtrace_symbols(site.frames.data(), static_cast<int>(site.frames.size())), &std::free);
+            for (std::size_t i = 0; symbols && i < site.frames.size(); ++i)
+               out << "      " << symbols.get()[i] << "\n";
+         }
+      }
+   }
+};
+
+/**
+ * @brief The profiled_mutex class
+ * Lockable wrapper over M which feeds lock_stats and registers them in lock_registry.
+ * Usable with make_locks, std::lock and the std guards. With a recursive M only the
+ * outermost acquisition is counted and its hold time runs until the matching last unlock;
+ * nested locks by the owner are never contended and add nothing.
+ */
+template <typename M = std::mutex>
+class profiled_mutex
+{
+   using clock = std::chrono::steady_clock;
+
+   M _m;
+   std::shared_ptr<lock_stats> _stats;
+   clock::time_point _acquired;
+   unsigned _depth {0};   // only touched by the owner
+
+   // wait of the current owner, -1 when it did not contend; owner only as well
+   void* _site[lock_stats::site_depth];
+   int _site_depth {-1};
+   std::uint64_t _waited {0};
+
+   static std::uint64_t since(clock::time_point start) noexcept
+   {
+      return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count());
+   }
+
+   void acquired() noexcept
+   {
+      if (_depth++ > 0)
+         return;
+
+      _stats->acquisitions.fetch_add(1, std::memory_order_relaxed);
+      _acquired = clock::now();
+   }
+
+public:
+   explicit profiled_mutex(std::string name = "unnamed")
+   : _stats(std::make_shared<lock_stats>(std::move(name)))
+   {
+      lock_registry::instance().add(_stats);
+   }
+
+   ~profiled_mutex()
+   {
+      lock_registry::instance().remove(_stats);
+   }
+
+   profiled_mutex(profiled_mutex const&) = delete;
+   profiled_mutex& operator=(profiled_mutex const&) = delete;
+
+   void lock()
+   {
+      if (_m.try_lock())
+      {
+         acquired();
+         return;
+      }
+
+      // the first frame is this function; captured before blocking so the unwind
+      // is not paid inside the critical section
+      void* frames[lock_stats::site_depth + 1];
+      auto depth = ::backtrace(frames, lock_stats::site_depth + 1);
+
+      auto start = clock::now();
+      _m.lock();
+      _waited = since(start);
+      _site_depth = std::max(depth - 1, 0);
+      std::copy(frames + 1, frames + 1 + _site_depth, _site);
+      acquired();
+   }
+
+   bool try_lock()
+   {
+      if (!_m.try_lock())
+      {
+         _stats->failed_try_locks.fetch_add(1, std::memory_order_relaxed);
+         return false;
+      }
+      acquired();
+      return true;
+   }
+
+   void unlock()
+   {
+      if (--_depth > 0)
+      {
+         _m.unlock();
+         return;
+      }
+
+      _stats->hold_time.add(since(_acquired));
+
+      // the wait is recorded once the lock is released, add_wait takes the site
+      // table's mutex and may allocate
+      void* site[lock_stats::site_depth];
+      auto depth = _site_depth;
+      auto waited = _waited;
+      if (depth > 0)
+         std::copy(_site, _site + depth, site);
+      _site_depth = -1;
+      _m.unlock();
+
+      if (depth >= 0)
+         _stats->add_wait(waited, site, depth);
+   }
+
+   lock_stats const& stats() const noexcept
+   {
+      return *_stats;
+   }
+};
+
+}
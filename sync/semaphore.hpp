@@ -0,0 +1,74 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <atomic>
+#include "futex.hpp"
+
+namespace parallel {
+
+/**
+ * @brief The counting_semaphore class
+ * acquire() spins briefly and then sleeps on a futex while the count is zero,
+ * release() only enters the kernel if somebody sleeps.
+ */
+class counting_semaphore
+{
+   std::atomic<int> _count;
+   std::atomic<int> _sleepers {0};
+
+public:
+   explicit counting_semaphore(int desired) : _count(desired)
+   {   }
+
+   counting_semaphore(counting_semaphore const&) = delete;
+   counting_semaphore& operator=(counting_semaphore const&) = delete;
+
+   void release(int n = 1) noexcept
+   {
+      _count.fetch_add(n);
+      detail::wake_sleepers(_count, _sleepers, n);
+   }
+
+   bool try_acquire() noexcept
+   {
+      auto c = _count.load(std::memory_order_relaxed);
+      while (c > 0)
+      {
+         if (_count.compare_exchange_weak(c, c - 1, std::memory_order_acquire, std::memory_order_relaxed))
+            return true;
+      }
+      return false;
+   }
+
+   void acquire() noexcept
+   {
+      while (!try_acquire())
+         detail::spin_then_wait(_count, 0, _sleepers);
+   }
+};
+
+}
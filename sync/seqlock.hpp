@@ -0,0 +1,107 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include "spin_lock.hpp"
+
+namespace parallel {
+
+/**
+ * @brief The seqlock class
+ * Publishes a trivially copyable snapshot to any number of readers. Readers copy the
+ * payload optimistically and retry if a store overlapped; they never block a writer and
+ * never write shared memory. store() is for a single writer thread, concurrent writers
+ * need their own serialization.
+ * The payload is kept in relaxed atomic words, so the racing copy is well defined.
+ */
+template <typename T>
+class seqlock
+{
+   static_assert(std::is_trivially_copyable<T>::value, "seqlock: T must be trivially copyable");
+
+   using word = std::uintptr_t;
+   static constexpr std::size_t words_count = (sizeof(T) + sizeof(word) - 1) / sizeof(word);
+
+   std::atomic<unsigned> _seq {0};
+   std::array<std::atomic<word>, words_count> _words {};
+
+public:
+   seqlock() = default;
+
+   explicit seqlock(T const& value)
+   {
+      store(value);
+   }
+
+   seqlock(seqlock const&) = delete;
+   seqlock& operator=(seqlock const&) = delete;
+
+   void store(T const& value) noexcept
+   {
+      word buffer[words_count] = {};
+      std::memcpy(buffer, &value, sizeof(T));
+
+      auto seq = _seq.load(std::memory_order_relaxed);
+      _seq.store(seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+
+      for (std::size_t i = 0; i < words_count; ++i)
+         _words[i].store(buffer[i], std::memory_order_relaxed);
+
+      _seq.store(seq + 2, std::memory_order_release);
+   }
+
+   T load() const noexcept
+   {
+      word buffer[words_count];
+      detail::backoff b;
+      while (true)
+      {
+         auto before = _seq.load(std::memory_order_acquire);
+         if ((before & 1) == 0)
+         {
+            for (std::size_t i = 0; i < words_count; ++i)
+               buffer[i] = _words[i].load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (_seq.load(std::memory_order_relaxed) == before)
+               break;
+         }
+         b.pause();
+      }
+
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+      std::memcpy(&value, buffer, sizeof(T));
+      return *reinterpret_cast<T*>(&value);
+   }
+};
+
+}
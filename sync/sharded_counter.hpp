@@ -0,0 +1,178 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include "spin_lock.hpp"
+#include "utility/thread_specific.hpp"
+
+/**
+ * Example
+ *
+ * parallel::sharded_counter requests;
+ * parallel::sharded_accumulator<double> latency_us;
+ * pool.submit([&]{ requests.add(); latency_us.record(us); });
+ * ...
+ * auto s = latency_us.snapshot();   // s.count, s.min, s.max, s.sum, s.mean()
+ */
+
+namespace parallel {
+
+namespace detail {
+
+constexpr std::size_t counter_slots = 64;
+
+inline std::size_t counter_slot() noexcept
+{
+   return thread_ordinal() % counter_slots;
+}
+
+}
+
+/**
+ * @brief The sharded_counter class
+ * Counter spread over cache-line sized slots, one per thread (round-robin beyond 64
+ * threads), so concurrent add() calls do not bounce a shared line. load() sums the
+ * slots; it is exact once the writers are quiet, a running total otherwise.
+ */
+class sharded_counter
+{
+   // padded rather than over-aligned, C++14 new ignores extended alignment; the values
+   // of two slots are a cache line apart wherever the counter is placed
+   struct slot
+   {
+      std::atomic<std::int64_t> value {0};
+      char _pad[64];
+   };
+
+   std::array<slot, detail::counter_slots> _slots;
+
+public:
+   sharded_counter() = default;
+   sharded_counter(sharded_counter const&) = delete;
+   sharded_counter& operator=(sharded_counter const&) = delete;
+
+   void add(std::int64_t n = 1) noexcept
+   {
+      _slots[detail::counter_slot()].value.fetch_add(n, std::memory_order_relaxed);
+   }
+
+   std::int64_t load() const noexcept
+   {
+      std::int64_t total = 0;
+      for (auto const& s : _slots)
+         total += s.value.load(std::memory_order_relaxed);
+      return total;
+   }
+
+   void reset() noexcept
+   {
+      for (auto& s : _slots)
+         s.value.store(0, std::memory_order_relaxed);
+   }
+};
+
+template <typename T>
+struct accumulator_stats
+{
+   std::uint64_t count {0};
+   T sum {};
+   T min {std::numeric_limits<T>::max()};
+   T max {std::numeric_limits<T>::lowest()};
+
+   double mean() const noexcept
+   {
+      return count ? static_cast<double>(sum) / count : 0.0;
+   }
+};
+
+/**
+ * @brief The sharded_accumulator class
+ * Count, sum, min and max of recorded samples, kept per thread slot like
+ * sharded_counter. A slot is guarded by a spin_lock that is practically never
+ * contended, so record() costs one atomic exchange and every slot is read consistent.
+ */
+template <typename T>
+class sharded_accumulator
+{
+   // padded like sharded_counter's slots
+   struct slot
+   {
+      mutable spin_lock mut;
+      accumulator_stats<T> stats;
+      char _pad[64];
+   };
+
+   std::array<slot, detail::counter_slots> _slots;
+
+public:
+   sharded_accumulator() = default;
+   sharded_accumulator(sharded_accumulator const&) = delete;
+   sharded_accumulator& operator=(sharded_accumulator const&) = delete;
+
+   void record(T value) noexcept
+   {
+      auto& s = _slots[detail::counter_slot()];
+      std::lock_guard<spin_lock> lk(s.mut);
+      ++s.stats.count;
+      s.stats.sum += value;
+      if (value < s.stats.min)
+         s.stats.min = value;
+      if (s.stats.max < value)
+         s.stats.max = value;
+   }
+
+   accumulator_stats<T> snapshot() const noexcept
+   {
+      accumulator_stats<T> total;
+      for (auto const& s : _slots)
+      {
+         std::lock_guard<spin_lock> lk(s.mut);
+         total.count += s.stats.count;
+         total.sum += s.stats.sum;
+         if (s.stats.min < total.min)
+            total.min = s.stats.min;
+         if (total.max < s.stats.max)
+            total.max = s.stats.max;
+      }
+      return total;
+   }
+
+   void reset() noexcept
+   {
+      for (auto& s : _slots)
+      {
+         std::lock_guard<spin_lock> lk(s.mut);
+         s.stats = accumulator_stats<T>();
+      }
+   }
+};
+
+}
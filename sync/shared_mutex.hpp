@@ -0,0 +1,160 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+
+namespace parallel {
+
+/**
+ * @brief The read_indicator class
+ * Count of active readers spread over cache-line sized slots. Threads are assigned
+ * to the slots round-robin and keep their slot, so arrive() and depart() of one
+ * reader touch only that reader's line. empty() has to scan all slots.
+ */
+class read_indicator
+{
+public:
+   static constexpr std::size_t slots_count = 64;
+
+private:
+   // padded rather than over-aligned, C++14 new ignores extended alignment;
+   // two counters are always a cache line apart
+   struct slot
+   {
+      std::atomic<long> readers {0};
+      char _pad[64];
+   };
+
+   std::array<slot, slots_count> _slots;
+
+   static std::size_t own_slot() noexcept
+   {
+      static std::atomic<std::size_t> next {0};
+      static thread_local std::size_t const index = next.fetch_add(1, std::memory_order_relaxed) % slots_count;
+      return index;
+   }
+
+public:
+   void arrive() noexcept
+   {
+      _slots[own_slot()].readers.fetch_add(1);
+   }
+
+   void depart() noexcept
+   {
+      _slots[own_slot()].readers.fetch_sub(1, std::memory_order_release);
+   }
+
+   bool empty() const noexcept
+   {
+      for (auto const& s : _slots)
+      {
+         if (s.readers.load() != 0)
+            return false;
+      }
+      return true;
+   }
+};
+
+/**
+ * @brief The sharded_shared_mutex class
+ * Reader-writer lock for read-mostly data. Shared owners are counted in a
+ * read_indicator, so concurrent readers do not bounce a common cache line.
+ * A writer raises the writer flag and waits for the readers to drain; new readers
+ * back off while the flag is up, so writers are not starved.
+ * Satisfies SharedMutex, use it with std::shared_lock or make_locks(shared(m)).
+ */
+class sharded_shared_mutex
+{
+   read_indicator _readers;                 // ends with a pad
+   std::atomic_bool _writer {false};        // read by every reader
+   char _pad[64];
+   std::mutex _writers;
+
+public:
+   sharded_shared_mutex() = default;
+   sharded_shared_mutex(sharded_shared_mutex const&) = delete;
+   sharded_shared_mutex& operator=(sharded_shared_mutex const&) = delete;
+
+   void lock()
+   {
+      _writers.lock();
+      _writer.store(true);
+      while (!_readers.empty())
+         std::this_thread::yield();
+   }
+
+   bool try_lock()
+   {
+      if (!_writers.try_lock())
+         return false;
+
+      _writer.store(true);
+      if (_readers.empty())
+         return true;
+
+      _writer.store(false, std::memory_order_release);
+      _writers.unlock();
+      return false;
+   }
+
+   void unlock()
+   {
+      _writer.store(false, std::memory_order_release);
+      _writers.unlock();
+   }
+
+   void lock_shared()
+   {
+      while (!try_lock_shared())
+      {
+         while (_writer.load(std::memory_order_relaxed))
+            std::this_thread::yield();
+      }
+   }
+
+   bool try_lock_shared()
+   {
+      _readers.arrive();
+      if (!_writer.load())
+         return true;
+
+      _readers.depart();
+      return false;
+   }
+
+   void unlock_shared()
+   {
+      _readers.depart();
+   }
+};
+
+}
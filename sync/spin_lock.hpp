@@ -0,0 +1,242 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/**
+ * Lockables for very short critical sections. All of them satisfy Lockable,
+ * so they work with make_locks, the std guards and parallel::queue<T, Lock>.
+ *
+ * spin_lock   - test-and-test-and-set with exponential backoff, not fair
+ * ticket_lock - FIFO fair, all waiters spin on the same counter
+ * mcs_lock    - FIFO fair, every waiter spins on its own cache line
+ */
+
+namespace parallel {
+
+namespace detail {
+
+inline void cpu_relax() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+   asm volatile("yield" ::: "memory");
+#endif
+}
+
+// Spins with an exponentially growing number of pauses, past the limit it
+// yields the time slice instead, so an oversubscribed machine still progresses.
+class backoff
+{
+   static constexpr unsigned spin_limit = 1024;
+   unsigned _spins {1};
+
+public:
+   void pause() noexcept
+   {
+      if (_spins > spin_limit)
+      {
+         std::this_thread::yield();
+         return;
+      }
+
+      for (unsigned i = 0; i < _spins; ++i)
+         cpu_relax();
+      _spins <<= 1;
+   }
+};
+
+}
+
+class spin_lock
+{
+   std::atomic_bool _locked {false};
+
+public:
+   spin_lock() = default;
+   spin_lock(spin_lock const&) = delete;
+   spin_lock& operator=(spin_lock const&) = delete;
+
+   void lock() noexcept
+   {
+      detail::backoff b;
+      while (_locked.exchange(true, std::memory_order_acquire))
+      {
+         while (_locked.load(std::memory_order_relaxed))
+            b.pause();
+      }
+   }
+
+   bool try_lock() noexcept
+   {
+      return !_locked.load(std::memory_order_relaxed) && !_locked.exchange(true, std::memory_order_acquire);
+   }
+
+   void unlock() noexcept
+   {
+      _locked.store(false, std::memory_order_release);
+   }
+};
+
+class ticket_lock
+{
+   std::atomic<unsigned> _next {0};
+   std::atomic<unsigned> _serving {0};
+
+public:
+   ticket_lock() = default;
+   ticket_lock(ticket_lock const&) = delete;
+   ticket_lock& operator=(ticket_lock const&) = delete;
+
+   void lock() noexcept
+   {
+      auto const ticket = _next.fetch_add(1, std::memory_order_relaxed);
+      detail::backoff b;
+      while (_serving.load(std::memory_order_acquire) != ticket)
+         b.pause();
+   }
+
+   bool try_lock() noexcept
+   {
+      auto serving = _serving.load(std::memory_order_relaxed);
+      return _next.compare_exchange_strong(serving, serving + 1, std::memory_order_acquire, std::memory_order_relaxed);
+   }
+
+   void unlock() noexcept
+   {
+      _serving.store(_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+   }
+};
+
+/**
+ * @brief The mcs_lock class
+ * Queue lock of Mellor-Crummey and Scott. The queue nodes come from a per-thread
+ * cache, so the plain lock()/unlock() interface is kept and one thread may hold
+ * any number of mcs_locks at once.
+ */
+class mcs_lock
+{
+   // padded rather than over-aligned, C++14 new ignores extended alignment;
+   // the flags of two nodes are still always a cache line apart
+   struct node
+   {
+      std::atomic<node*> next {nullptr};
+      std::atomic_bool waiting {false};
+      char _pad[64];
+   };
+
+   std::atomic<node*> _tail {nullptr};
+   node* _holder {nullptr};
+
+   static std::vector<std::unique_ptr<node>>& node_cache()
+   {
+      static thread_local std::vector<std::unique_ptr<node>> cache;
+      return cache;
+   }
+
+   static node* acquire_node()
+   {
+      auto& cache = node_cache();
+      if (cache.empty())
+         return new node;
+
+      auto n = cache.back().release();
+      cache.pop_back();
+      return n;
+   }
+
+   static void release_node(node* n)
+   {
+      node_cache().emplace_back(n);
+   }
+
+public:
+   mcs_lock() = default;
+   mcs_lock(mcs_lock const&) = delete;
+   mcs_lock& operator=(mcs_lock const&) = delete;
+
+   void lock()
+   {
+      auto n = acquire_node();
+      n->next.store(nullptr, std::memory_order_relaxed);
+      n->waiting.store(true, std::memory_order_relaxed);
+
+      auto pred = _tail.exchange(n, std::memory_order_acq_rel);
+      if (pred)
+      {
+         pred->next.store(n, std::memory_order_release);
+         detail::backoff b;
+         while (n->waiting.load(std::memory_order_acquire))
+            b.pause();
+      }
+      _holder = n;
+   }
+
+   bool try_lock()
+   {
+      auto n = acquire_node();
+      n->next.store(nullptr, std::memory_order_relaxed);
+
+      node* expected = nullptr;
+      if (!_tail.compare_exchange_strong(expected, n, std::memory_order_acq_rel, std::memory_order_relaxed))
+      {
+         release_node(n);
+         return false;
+      }
+      _holder = n;
+      return true;
+   }
+
+   void unlock()
+   {
+      auto n = _holder;
+      auto succ = n->next.load(std::memory_order_acquire);
+      if (!succ)
+      {
+         auto expected = n;
+         if (_tail.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel, std::memory_order_relaxed))
+         {
+            release_node(n);
+            return;
+         }
+
+         // a successor has swapped the tail but not linked itself yet
+         while (!(succ = n->next.load(std::memory_order_acquire)))
+            detail::cpu_relax();
+      }
+
+      succ->waiting.store(false, std::memory_order_release);
+      release_node(n);
+   }
+};
+
+}
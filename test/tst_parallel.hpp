@@ -28,14 +28,52 @@
 #include "gtest/gtest.h"
 #include "gmock/gmock-matchers.h"
 
+#include <algorithm>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <map>
 #include <memory>
+#include <numeric>
+#include <shared_mutex>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
 
 #include "raii/multi_lock.hpp"
 #include "raii/scoped_thread.hpp"
+#include "sync/latch.hpp"
+#include "sync/left_right.hpp"
+#include "sync/profiled_mutex.hpp"
+#include "sync/semaphore.hpp"
+#include "sync/seqlock.hpp"
+#include "sync/sharded_counter.hpp"
+#include "sync/shared_mutex.hpp"
+#include "sync/spin_lock.hpp"
+#include "containers/channel.hpp"
+#include "containers/concurrent_hash_map.hpp"
+#include "containers/disruptor.hpp"
+#include "containers/lock_free_stack.hpp"
+#include "containers/lru_cache.hpp"
 #include "containers/thread_pool.hpp"
+#include "containers/work_stealing_deque.hpp"
+#include "io/async_logger.hpp"
+#include "io/reactor.hpp"
+#include "io/shm_ring.hpp"
+#include "io/spill_log.hpp"
 #include "utility/sequence.hpp"
 #include "utility/property.hpp"
 #include "utility/not_null.hpp"
+#include "utility/thread_specific.hpp"
+#include "utility/topology.hpp"
+#include "utility/arena.hpp"
+#include "utility/object_pool.hpp"
+
+#if defined(__cpp_impl_coroutine)
+#include "containers/coroutine.hpp"
+#endif
 
 #include <iostream>
 using namespace testing;
@@ -186,6 +224,403 @@ TEST(paralel, paralel)
    EXPECT_EQ(2, m1.unloc_num);
 }
 
+TEST(paralel, multi_lock_ordered)
+{
+   struct ranked
+   {
+      int id;
+      std::vector<int>& order;
+
+      void lock() { order.push_back(id); }
+      bool try_lock() { order.push_back(id); return true; }
+      void unlock() {}
+      int rank() const { return id; }
+   };
+
+   std::vector<int> order;
+   ranked r3 {3, order};
+   ranked r1 {1, order};
+   ranked r2 {2, order};
+   {
+      auto guards = parallel::raii::make_locks(parallel::raii::ordered, r3, r1, r2);
+      EXPECT_EQ(std::vector<int>({1, 2, 3}), order);
+   }
+
+   std::mutex accounts[8];
+   long balance[8] = {};
+   std::vector<std::thread> threads;
+   for (auto t : boost::irange(4))
+   {
+      threads.emplace_back([&accounts, &balance, t]{
+         for (auto n : boost::irange(2000))
+         {
+            int from = (t + n) % 8;
+            int to = (t * 3 + n * 5 + 1) % 8;
+            if (from == to)
+               continue;
+            auto guards = parallel::raii::make_locks(parallel::raii::ordered, accounts[from], accounts[to]);
+            --balance[from];
+            ++balance[to];
+         }
+      });
+   }
+   for (auto& t : threads)
+      t.join();
+   EXPECT_EQ(0, std::accumulate(std::begin(balance), std::end(balance), 0l));
+
+   std::shared_timed_mutex config;
+   std::recursive_mutex mixed;
+   {
+      auto guards = parallel::raii::make_locks(parallel::raii::ordered, mixed, parallel::raii::shared(config));
+      EXPECT_TRUE(config.try_lock_shared());
+      config.unlock_shared();
+   }
+}
+
+TEST(paralel, multi_lock_shared)
+{
+   std::shared_timed_mutex config;
+   parallel::sharded_shared_mutex table;
+   std::mutex m;
+
+   {
+      auto readers = parallel::raii::make_locks(parallel::raii::shared(config), parallel::raii::shared(table), m);
+
+      std::thread other([&config, &table]{
+         auto again = parallel::raii::make_locks(parallel::raii::shared(config), parallel::raii::shared(table));
+         EXPECT_FALSE(config.try_lock());
+         EXPECT_FALSE(table.try_lock());
+      });
+      other.join();
+   }
+
+   EXPECT_TRUE(table.try_lock());
+   EXPECT_FALSE(table.try_lock_shared());
+   table.unlock();
+
+   auto single = parallel::raii::make_locks(parallel::raii::shared(config));
+   EXPECT_TRUE(config.try_lock_shared());
+   config.unlock_shared();
+}
+
+TEST(paralel, sharded_shared_mutex)
+{
+   parallel::sharded_shared_mutex m;
+   long first = 0;
+   long second = 0;
+   std::atomic_bool torn {false};
+
+   std::vector<std::thread> threads;
+   for (auto i : boost::irange(4))
+   {
+      threads.emplace_back([&, i]{
+         for (auto n : boost::irange(2000))
+         {
+            if (n % 10 == 0 && i % 2 == 0)
+            {
+               std::lock_guard<parallel::sharded_shared_mutex> lk(m);
+               ++first;
+               ++second;
+            }
+            else
+            {
+               std::shared_lock<parallel::sharded_shared_mutex> lk(m);
+               if (first != second)
+                  torn = true;
+            }
+         }
+      });
+   }
+   for (auto& t : threads)
+      t.join();
+
+   EXPECT_FALSE(torn);
+   EXPECT_EQ(400, first);
+}
+
+template <typename Lock>
+void lock_stress()
+{
+   Lock m;
+   long counter = 0;
+   std::vector<std::thread> threads;
+   for (int i = 0; i < 4; ++i)
+   {
+      threads.emplace_back([&m, &counter]{
+         for (int n = 0; n < 5000; ++n)
+         {
+            std::lock_guard<Lock> lk(m);
+            ++counter;
+         }
+      });
+   }
+   for (auto& t : threads)
+      t.join();
+
+   EXPECT_EQ(4 * 5000, counter);
+   EXPECT_TRUE(m.try_lock());
+   EXPECT_FALSE(m.try_lock());
+   m.unlock();
+}
+
+TEST(paralel, spin_locks)
+{
+   lock_stress<parallel::spin_lock>();
+   lock_stress<parallel::ticket_lock>();
+   lock_stress<parallel::mcs_lock>();
+
+   parallel::spin_lock s;
+   parallel::ticket_lock t;
+   parallel::mcs_lock m1;
+   parallel::mcs_lock m2;
+   {
+      auto guards = parallel::raii::make_locks(s, t, m1, m2);
+      EXPECT_FALSE(m2.try_lock());
+   }
+   EXPECT_TRUE(m1.try_lock());
+   m1.unlock();
+
+   parallel::queue<int, parallel::ticket_lock> q;
+   std::thread producer([&q]{ q.push(7); });
+   int value = 0;
+   q.wait_and_pop(value);
+   producer.join();
+   EXPECT_EQ(7, value);
+   EXPECT_TRUE(q.empty());
+}
+
+// The cache lines touched by each slot's data (the slot minus its trailing pad) must
+// not overlap those of the next slot, wherever the heap put the object.
+template <typename Sharded>
+bool slots_on_own_lines(std::size_t data_size)
+{
+   auto sharded = std::make_unique<Sharded>();
+   auto const base = reinterpret_cast<std::uintptr_t>(sharded.get());
+   auto const stride = sizeof(Sharded) / parallel::detail::counter_slots;
+   for (std::size_t i = 0; i + 1 < parallel::detail::counter_slots; ++i)
+   {
+      auto last_line = (base + i * stride + data_size - 1) / 64;
+      auto next_line = (base + (i + 1) * stride) / 64;
+      if (last_line >= next_line)
+         return false;
+   }
+   return true;
+}
+
+TEST(paralel, sharded_counters)
+{
+   EXPECT_TRUE(slots_on_own_lines<parallel::sharded_counter>(sizeof(std::atomic<std::int64_t>)));
+   EXPECT_TRUE(slots_on_own_lines<parallel::sharded_accumulator<long>>(
+      sizeof(parallel::sharded_accumulator<long>) / parallel::detail::counter_slots - 64));
+
+   parallel::sharded_counter requests;
+   parallel::sharded_accumulator<long> latency;
+   parallel::enumerable_thread_specific<std::vector<int>> seen([]{ return std::vector<int>(1, -1); });
+   {
+      std::vector<parallel::raii::join_thread> threads;
+      for (int t = 0; t < 8; ++t)
+         threads.emplace_back([&, t]{
+            for (int i = 0; i < 10000; ++i)
+            {
+               requests.add();
+               latency.record(t * 10000 + i);
+            }
+            seen.local().push_back(t);
+         });
+   }
+   EXPECT_EQ(80000, requests.load());
+
+   auto stats = latency.snapshot();
+   EXPECT_EQ(80000u, stats.count);
+   EXPECT_EQ(0, stats.min);
+   EXPECT_EQ(79999, stats.max);
+   EXPECT_DOUBLE_EQ(39999.5, stats.mean());
+
+   EXPECT_EQ(8u, seen.size());
+   int sum = 0;
+   seen.for_each([&sum](std::vector<int>& v){
+      EXPECT_EQ(2u, v.size());
+      sum += v.back();
+   });
+   EXPECT_EQ(28, sum);
+   seen.local().push_back(100);
+   EXPECT_EQ(&seen.local(), &seen.local());
+   EXPECT_EQ(9u, seen.size());
+
+   requests.reset();
+   latency.reset();
+   EXPECT_EQ(0, requests.load());
+   EXPECT_EQ(0u, latency.snapshot().count);
+}
+
+TEST(paralel, seqlock)
+{
+   struct price
+   {
+      long bid;
+      long ask;
+      char venue[3];
+   };
+
+   parallel::seqlock<price> snapshot {price{0, 0, "A"}};
+   std::atomic_bool stop {false};
+   std::atomic_bool torn {false};
+
+   std::vector<std::thread> readers;
+   for (int i = 0; i < 3; ++i)
+   {
+      readers.emplace_back([&]{
+         while (!stop)
+         {
+            auto p = snapshot.load();
+            if (p.ask != p.bid + 1 && !(p.bid == 0 && p.ask == 0))
+               torn = true;
+         }
+      });
+   }
+
+   for (auto n : boost::irange(1, 20000))
+      snapshot.store(price{n, n + 1, "B"});
+   stop = true;
+   for (auto& t : readers)
+      t.join();
+
+   EXPECT_FALSE(torn);
+   EXPECT_EQ(19999, snapshot.load().bid);
+   EXPECT_EQ('B', snapshot.load().venue[0]);
+}
+
+TEST(paralel, left_right)
+{
+   parallel::left_right<std::map<int, int>> routes;
+   std::atomic_bool stop {false};
+   std::atomic_bool torn {false};
+
+   std::vector<std::thread> readers;
+   for (int i = 0; i < 3; ++i)
+   {
+      readers.emplace_back([&]{
+         while (!stop)
+         {
+            auto consistent = routes.read([](std::map<int, int> const& table){
+               long sum = 0;
+               for (auto const& r : table)
+                  sum += r.second;
+               return sum == 0;
+            });
+            if (!consistent)
+               torn = true;
+         }
+      });
+   }
+
+   for (auto n : boost::irange(1, 2000))
+   {
+      routes.modify([n](std::map<int, int>& table){
+         table[n % 16] += n;
+         table[n % 16 + 16] -= n;
+      });
+   }
+   stop = true;
+   for (auto& t : readers)
+      t.join();
+
+   EXPECT_FALSE(torn);
+   EXPECT_EQ(32u, routes.load().size());
+   routes.store({{1, 1}});
+   EXPECT_EQ(1, routes.read([](std::map<int, int> const& table){ return table.at(1); }));
+}
+
+TEST(paralel, latch_barrier_semaphore)
+{
+   const int workers = 4;
+   parallel::latch started(workers);
+   std::atomic_int phases {0};
+   std::atomic_bool out_of_step {false};
+   std::vector<std::atomic_int> steps(workers);
+   parallel::barrier<std::function<void()>> step(workers, [&phases]{ ++phases; });
+   parallel::counting_semaphore slots(2);
+   std::atomic_int inside {0};
+   std::atomic_int too_many {0};
+
+   std::vector<std::thread> threads;
+   for (auto i : boost::irange(workers))
+   {
+      threads.emplace_back([&, i]{
+         started.arrive_and_wait();
+         for (auto n : boost::irange(200))
+         {
+            steps[i] = n;
+            step.arrive_and_wait();
+            for (auto const& s : steps)
+            {
+               if (s < n)
+                  out_of_step = true;
+            }
+            step.arrive_and_wait();
+
+            slots.acquire();
+            if (++inside > 2)
+               ++too_many;
+            --inside;
+            slots.release();
+         }
+      });
+   }
+   for (auto& t : threads)
+      t.join();
+
+   EXPECT_TRUE(started.try_wait());
+   EXPECT_EQ(400, phases);
+   EXPECT_FALSE(out_of_step);
+   EXPECT_EQ(0, too_many);
+   EXPECT_TRUE(slots.try_acquire());
+   EXPECT_TRUE(slots.try_acquire());
+   EXPECT_FALSE(slots.try_acquire());
+}
+
+TEST(paralel, profiled_mutex)
+{
+   parallel::profiled_mutex<> routes {"routes"};
+   parallel::profiled_mutex<std::recursive_mutex> sessions {"sessions"};
+   std::mutex plain;
+
+   {
+      auto guards = parallel::raii::make_locks(routes, sessions, plain);
+   }
+   {
+      // nested locks of a recursive mutex count once
+      std::lock_guard<parallel::profiled_mutex<std::recursive_mutex>> outer(sessions);
+      std::lock_guard<parallel::profiled_mutex<std::recursive_mutex>> inner(sessions);
+   }
+
+   std::promise<void> holding;
+   std::thread holder([&routes, &holding]{
+      std::lock_guard<parallel::profiled_mutex<>> lk(routes);
+      holding.set_value();
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+   });
+   holding.get_future().wait();
+   {
+      std::unique_lock<parallel::profiled_mutex<>> lk(routes);
+   }
+   holder.join();
+
+   EXPECT_EQ(3u, routes.stats().acquisitions);
+   EXPECT_EQ(1u, routes.stats().contended);
+   EXPECT_EQ(2u, sessions.stats().acquisitions);
+   EXPECT_LE(10u * 1000 * 1000, routes.stats().hold_time.percentile(0.99));
+   EXPECT_EQ(1u, routes.stats().top_waiters(3).size());
+
+   auto top = parallel::lock_registry::instance().most_contended(1);
+   ASSERT_EQ(1u, top.size());
+   EXPECT_EQ("routes", top.front()->name);
+
+   std::ostringstream report;
+   parallel::lock_registry::instance().dump(report, 2);
+   EXPECT_THAT(report.str(), HasSubstr("lock 'routes': acquisitions 3, contended 1"));
+}
+
 TEST(paralel, not_null)
 {
    not_null<std::shared_ptr<int>> nnsp = std::make_shared<int>( 6 );
@@ -197,6 +632,30 @@ TEST(paralel, not_null)
    EXPECT_EQ( true, static_cast<bool>( nnup.get() ) );
 }
 
+TEST(paralel, topology)
+{
+   std::string const file = __FILE__;
+   auto const fixture = file.substr(0, file.find_last_of('/') + 1) + "fixtures/sysfs_2s_2c_smt";
+
+   // 2 packages x 2 cores x 2 threads, cpus 4-7 are the SMT siblings of 0-3
+   auto topo = parallel::topology::load(fixture);
+   ASSERT_EQ(8u, topo.cpus().size());
+   EXPECT_EQ(std::vector<int>({0, 1, 2, 3}), topo.one_per_core());
+   EXPECT_EQ(std::vector<int>({1, 5}), topo.siblings(5));
+   EXPECT_EQ(std::vector<int>({2, 6}), topo.sharing_cache(6, 2));
+   EXPECT_EQ(std::vector<int>({0, 1, 4, 5}), topo.sharing_cache(0, 3));
+   EXPECT_EQ(std::vector<int>({2, 3, 6, 7}), topo.node_cpus(1));
+   EXPECT_EQ(1, topo.find(7)->package);
+
+   auto masked = parallel::topology::load(fixture, {1, 4, 5, 6});
+   EXPECT_EQ(std::vector<int>({1, 4, 6}), masked.one_per_core());
+   EXPECT_EQ(std::vector<int>({1, 4, 5}), masked.sharing_cache(4, 3));
+   EXPECT_EQ(nullptr, masked.find(0));
+
+   EXPECT_EQ(std::vector<int>({0, 1, 2, 3, 8, 10, 11}), parallel::topology::parse_cpulist("0-3,8,10-11\n"));
+   EXPECT_FALSE(parallel::topology::system().cpus().empty());
+}
+
 TEST(paralel, scoped_thread)
 {
    {
@@ -213,6 +672,261 @@ TEST(paralel, scoped_thread)
 }
 
 
+TEST(paralel, scoped_thread_attributes)
+{
+   // pin to a CPU the process may use, CPU 0 can be outside the cpuset (taskset, containers)
+   cpu_set_t allowed;
+   ASSERT_EQ(0, ::sched_getaffinity(0, sizeof(allowed), &allowed));
+   int cpu = 0;
+   while (!CPU_ISSET(cpu, &allowed))
+      ++cpu;
+
+   parallel::raii::thread_attributes attr;
+   attr.name = "tst-worker-with-long-name";
+   attr.cpus = {cpu};
+   attr.stack_size = 256 * 1024;
+   attr.fifo_priority = 1;
+   attr.nice = 5;
+
+   std::string name;
+   bool pinned = false;
+   std::size_t stack_size = 0;
+   int sum = 0;
+   {
+      parallel::raii::join_thread t(attr, [&](int a, int b){
+         char buf[16] = {};
+         ::pthread_getname_np(::pthread_self(), buf, sizeof(buf));
+         name = buf;
+
+         cpu_set_t set;
+         ::pthread_getaffinity_np(::pthread_self(), sizeof(set), &set);
+         pinned = CPU_COUNT(&set) == 1 && CPU_ISSET(cpu, &set);
+
+         pthread_attr_t self;
+         ::pthread_getattr_np(::pthread_self(), &self);
+         ::pthread_attr_getstacksize(&self, &stack_size);
+         ::pthread_attr_destroy(&self);
+
+         sum = a + b;
+      }, 1, 2);
+
+      EXPECT_FALSE(t.get().joinable());
+   }
+
+   EXPECT_EQ("tst-worker-with", name);
+   EXPECT_TRUE(pinned);
+   // sanitizers enlarge the requested size, the default would be megabytes
+   EXPECT_LE(256u * 1024, stack_size);
+   EXPECT_GT(1024u * 1024, stack_size);
+   EXPECT_EQ(3, sum);
+
+   // arguments are moved in like std::thread, so move-only ones work with a stop_token too
+   int value = 0;
+   bool stop_possible = false;
+   {
+      parallel::raii::join_thread t(parallel::raii::thread_attributes{},
+                                    [&](parallel::stop_token token, std::unique_ptr<int> p){
+         stop_possible = token.stop_possible();
+         value = *p;
+      }, std::make_unique<int>(7));
+   }
+   EXPECT_TRUE(stop_possible);
+   EXPECT_EQ(7, value);
+}
+
+TEST(paralel, queue_close_and_stop)
+{
+   parallel::queue<int> q;
+   std::vector<int> consumed;
+   {
+      // blocked in wait_and_pop until the destructor requests the stop
+      parallel::raii::join_thread consumer([&](parallel::stop_token token){
+         int item;
+         while (q.wait_and_pop(item, token))
+            consumed.push_back(item);
+      });
+      EXPECT_TRUE(consumer.get_stop_token().stop_possible());
+
+      q.push(1);
+      q.push(2);
+      while (!q.empty())
+         std::this_thread::yield();
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+   EXPECT_EQ(2u, consumed.size());
+
+   int passed = 0;
+   parallel::raii::join_thread plain([&passed](int a){ passed = a; }, 7);
+   plain.get().join();
+   EXPECT_EQ(7, passed);
+
+   parallel::stop_source stopped;
+   stopped.request_stop();
+   int item = 0;
+   EXPECT_FALSE(q.wait_and_pop(item, stopped.get_token()));
+   bool called = false;
+   parallel::stop_callback immediately(stopped.get_token(), [&called]{ called = true; });
+   EXPECT_TRUE(called);
+
+   q.push(3);
+   std::vector<std::shared_ptr<int>> results(3);
+   {
+      std::vector<parallel::raii::join_thread> waiters;
+      for (auto& result : results)
+         waiters.emplace_back([&q, &result]{ result = q.wait_and_pop(); });
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      q.close();
+   }
+   EXPECT_EQ(1, std::count_if(results.begin(), results.end(), [](std::shared_ptr<int> const& r){ return r && *r == 3; }));
+   EXPECT_EQ(2, std::count(results.begin(), results.end(), nullptr));
+
+   EXPECT_TRUE(q.closed());
+   EXPECT_FALSE(q.push(4));
+   EXPECT_FALSE(q.wait_and_pop(item));
+   EXPECT_FALSE(q.try_pop(item));
+
+   std::atomic_bool deferred_closed {false};
+   parallel::queue<int> other;
+   EXPECT_EQ(parallel::pop_status::deferred,
+             other.pop_or_defer(item, [&deferred_closed](int* value){ deferred_closed = value == nullptr; }));
+   other.close();
+   EXPECT_TRUE(deferred_closed);
+   EXPECT_EQ(parallel::pop_status::closed, other.pop_or_defer(item, [](int*){}));
+
+   // the shared_ptr pops need no default constructor
+   struct no_default
+   {
+      explicit no_default(int v) : value(v) {}
+      int value;
+   };
+   parallel::queue<no_default> strict;
+   strict.push(no_default(5));
+   strict.push(no_default(6));
+   EXPECT_EQ(5, strict.wait_and_pop()->value);
+   EXPECT_EQ(6, strict.wait_and_pop(parallel::stop_source().get_token())->value);
+   strict.push(no_default(7));
+   EXPECT_EQ(7, strict.try_pop()->value);
+   EXPECT_EQ(nullptr, strict.try_pop());
+}
+
+TEST(paralel, queue_spill)
+{
+   char directory[] = "/tmp/parallel-spill-test-XXXXXX";
+   ASSERT_NE(nullptr, ::mkdtemp(directory));
+
+   {
+      parallel::spill_log log(directory, 64);
+      std::string batch;
+      EXPECT_FALSE(log.read(batch));
+      for (int i = 0; i < 5; ++i)
+         log.append(std::string(40, static_cast<char>('a' + i)));
+      EXPECT_EQ(5u, log.batches());
+      EXPECT_EQ(3u, log.segments());
+      for (int i = 0; i < 5; ++i)
+      {
+         ASSERT_TRUE(log.read(batch));
+         EXPECT_EQ(std::string(40, static_cast<char>('a' + i)), batch);
+      }
+      EXPECT_EQ(0u, log.segments());
+      EXPECT_EQ(0u, log.bytes());
+   }
+
+   parallel::spill_codec<std::string> codec {
+      [](std::string const& value, std::string& out){ out += value; },
+      [](char const* data, std::size_t size){ return std::string(data, size); }
+   };
+   parallel::spill_options options;
+   options.watermark = 100;
+   options.batch = 32;
+
+   parallel::queue<std::string> q;
+   q.spill_to(std::make_unique<parallel::spill_log>(directory, 4096), codec, options);
+   EXPECT_THROW(q.spill_to(std::make_unique<parallel::spill_log>(directory), codec, options), std::logic_error);
+
+   // the consumer is far behind: everything past the watermark goes to disk
+   int const count = 10000;
+   for (int i = 0; i < count; ++i)
+      q.push(std::to_string(i));
+   EXPECT_GT(q.spilled(), std::size_t(count - 100 - 32));
+   EXPECT_THROW(parallel::queue<std::string> copy(q), std::logic_error);
+
+   std::string value;
+   for (int i = 0; i < count / 2; ++i)
+   {
+      ASSERT_TRUE(q.try_pop(value));
+      ASSERT_EQ(std::to_string(i), value);
+   }
+
+   // keeps the order while a producer and a consumer run concurrently
+   std::vector<std::string> consumed;
+   {
+      parallel::raii::join_thread consumer([&q, &consumed]{
+         std::string v;
+         while (q.wait_and_pop(v))
+            consumed.push_back(v);
+      });
+      for (int i = count; i < 2 * count; ++i)
+         q.push(std::to_string(i));
+      q.close();
+   }
+   ASSERT_EQ(std::size_t(count + count / 2), consumed.size());
+   for (std::size_t i = 0; i < consumed.size(); ++i)
+      ASSERT_EQ(std::to_string(i + count / 2), consumed[i]);
+   EXPECT_EQ(0u, q.spilled());
+   EXPECT_TRUE(q.empty());
+
+   EXPECT_THROW(parallel::spill_log(std::string(directory) + "/missing"), std::system_error);
+
+   // a failing storage keeps the batches in memory instead of failing the pushes
+   struct flaky_storage : parallel::spill_storage
+   {
+      bool& full;
+      std::deque<std::string> batches;
+
+      explicit flaky_storage(bool& f) : full(f) {}
+
+      void append(std::string const& batch) override
+      {
+         if (full)
+            throw std::system_error(ENOSPC, std::system_category(), "append");
+         batches.push_back(batch);
+      }
+
+      bool read(std::string& batch) override
+      {
+         if (batches.empty())
+            return false;
+         batch = std::move(batches.front());
+         batches.pop_front();
+         return true;
+      }
+   };
+
+   bool full = true;
+   parallel::queue<std::string> flaky;
+   flaky.spill_to(std::make_unique<flaky_storage>(full), codec, options);
+   for (int i = 0; i < 1000; ++i)
+      EXPECT_TRUE(flaky.push(std::to_string(i)));
+   EXPECT_EQ(0u, flaky.spilled());
+   // one attempt per batch collected, not one per push
+   EXPECT_EQ(std::size_t((1000 - 100) / 32), flaky.spill_failures());
+   EXPECT_THROW(std::rethrow_exception(flaky.last_spill_error()), std::system_error);
+
+   full = false;
+   for (int i = 1000; i < 2000; ++i)
+      flaky.push(std::to_string(i));
+   EXPECT_LT(0u, flaky.spilled());
+   for (int i = 0; i < 2000; ++i)
+   {
+      ASSERT_TRUE(flaky.try_pop(value));
+      ASSERT_EQ(std::to_string(i), value);
+   }
+   EXPECT_TRUE(flaky.empty());
+
+   EXPECT_EQ(0, ::rmdir(directory));   // segments were unlinked as they were created
+}
+
 TEST(paralel, thread_pool)
 {
    std::atomic_int count = {0};
@@ -252,6 +966,951 @@ TEST(paralel, thread_pool)
    EXPECT_EQ(std::thread::hardware_concurrency(), count);
 }
 
+TEST(paralel, thread_pool_priority)
+{
+   const auto workers = std::thread::hardware_concurrency();
+   std::promise<void> gate;
+   std::shared_future<void> opened = gate.get_future().share();
+   std::atomic_uint blocked {0};
+
+   std::mutex m;
+   std::vector<int> order;
+   auto record = [&m, &order](int id){
+      std::lock_guard<std::mutex> l(m);
+      order.push_back(id);
+   };
+
+   {
+      parallel::thread_pool pool;
+      for (unsigned i = 0; i < workers; ++i)
+         pool.submit([&blocked, opened]{ ++blocked; opened.wait(); }, parallel::priority::high);
+
+      while (blocked != workers)
+         std::this_thread::yield();
+
+      pool.submit([&record]{ record(-1); }, parallel::priority::low);
+      for (auto i : boost::irange(100))
+         pool.submit([&record, i]{ record(i); }, parallel::priority::normal);
+      pool.submit([&record]{ record(-2); }, parallel::priority::high);
+
+      gate.set_value();
+      while (true)
+      {
+         std::lock_guard<std::mutex> l(m);
+         if (order.size() == 102)
+            break;
+      }
+   }
+
+   auto position = [&order](int id){
+      return std::distance(order.begin(), std::find(order.begin(), order.end(), id));
+   };
+
+   // the high task overtakes the queued normal ones, the low one is not starved
+   EXPECT_GT(static_cast<long>(workers) + 4, position(-2));
+   EXPECT_GT(100, position(-1));
+}
+
+TEST(paralel, thread_pool_timers)
+{
+   using namespace std::chrono;
+
+   std::promise<steady_clock::time_point> fired;
+   std::atomic_int ticks {0};
+   bool never_run = true;
+
+   parallel::thread_pool pool;
+
+   auto start = steady_clock::now();
+   pool.submit_after(milliseconds(20), [&fired]{ fired.set_value(steady_clock::now()); });
+
+   auto periodic = pool.submit_every(milliseconds(2), [&ticks]{ ++ticks; });
+
+   auto cancelled = pool.submit_at(steady_clock::now() + hours(1), [&never_run]{ never_run = false; });
+   EXPECT_TRUE(pool.cancel(cancelled));
+   EXPECT_FALSE(pool.cancel(cancelled));
+
+   EXPECT_LE(milliseconds(20), fired.get_future().get() - start);
+
+   while (ticks < 3)
+      std::this_thread::yield();
+   EXPECT_TRUE(pool.cancel(periodic));
+   EXPECT_TRUE(never_run);
+}
+
+TEST(paralel, thread_pool_blocking)
+{
+   using namespace std::chrono;
+
+   std::mutex m;
+   std::vector<std::thread::id> blocking_ids;
+   std::atomic_int continued {0};
+   std::atomic_int cpu_done {0};
+   std::atomic_bool continuation_on_blocking_thread {false};
+
+   parallel::thread_pool pool(4);
+
+   auto start = steady_clock::now();
+   for (int i = 0; i < 4; ++i)
+   {
+      pool.submit_blocking([&m, &blocking_ids]{
+         {
+            std::lock_guard<std::mutex> l(m);
+            blocking_ids.push_back(std::this_thread::get_id());
+         }
+         std::this_thread::sleep_for(milliseconds(50));
+      }, [&]{
+         std::lock_guard<std::mutex> l(m);
+         auto id = std::this_thread::get_id();
+         if (std::find(blocking_ids.begin(), blocking_ids.end(), id) != blocking_ids.end())
+            continuation_on_blocking_thread = true;
+         ++continued;
+      });
+   }
+
+   for (int i = 0; i < 100; ++i)
+      pool.submit([&cpu_done]{ ++cpu_done; });
+
+   // CPU work is not held up by the sleeping tasks
+   while (cpu_done != 100)
+      std::this_thread::yield();
+   EXPECT_GT(milliseconds(50), steady_clock::now() - start);
+
+   while (continued != 4)
+      std::this_thread::yield();
+   EXPECT_GT(milliseconds(4 * 50), steady_clock::now() - start);
+   EXPECT_FALSE(continuation_on_blocking_thread);
+}
+
+TEST(paralel, timer_wheel)
+{
+   std::vector<int> fired;
+   parallel::timer_wheel<int> wheel;
+
+   wheel.schedule(5, 5);
+   wheel.schedule(70, 70);
+   wheel.schedule(5000, 5000);
+   wheel.schedule((1ull << 24) + 100, -1);
+   auto cancelled = wheel.schedule(300, 300);
+   wheel.cancel(cancelled);
+
+   auto collect = [&fired](int v){ fired.push_back(v); };
+   EXPECT_EQ(5u, wheel.next_tick());
+   wheel.advance(4, collect);
+   EXPECT_TRUE(fired.empty());
+   wheel.advance(69, collect);
+   EXPECT_EQ(std::vector<int>({5}), fired);
+   EXPECT_EQ(70u, wheel.next_tick());
+   wheel.advance(70, collect);
+   EXPECT_EQ(std::vector<int>({5, 70}), fired);
+
+   // 5000 sits in level 2 until 4096, then in level 1 until 4992
+   EXPECT_EQ(4096u, wheel.next_tick());
+   wheel.advance(4096, collect);
+   EXPECT_EQ(4992u, wheel.next_tick());
+   wheel.advance(4999, collect);
+   EXPECT_EQ(5000u, wheel.next_tick());
+   wheel.advance(5000, collect);
+   EXPECT_EQ(std::vector<int>({5, 70, 5000}), fired);
+   wheel.advance((1ull << 24) + 99, collect);
+   EXPECT_EQ(3u, fired.size());
+   wheel.advance((1ull << 24) + 100, collect);
+   EXPECT_EQ(-1, fired.back());
+   EXPECT_TRUE(wheel.empty());
+
+   // a periodic entry is due every period, whatever the jumps in between
+   fired.clear();
+   wheel.schedule((1ull << 24) + 200, 1, 1000);
+   for (auto now = (1ull << 24) + 100; now < (1ull << 24) + 10200; now += 37)
+      wheel.advance(now, collect);
+   EXPECT_EQ(10u, fired.size());
+   EXPECT_EQ((1ull << 24) + 10176, wheel.next_tick());   // cascade of the level 1 slot holding 10200
+}
+
+TEST(paralel, object_pool_and_arena)
+{
+   using pool = parallel::fixed_size_pool<40>;
+   EXPECT_EQ(48u, pool::block_size);
+   auto first = pool::instance().allocate();
+   pool::instance().deallocate(first);
+   EXPECT_EQ(first, pool::instance().allocate());   // LIFO thread cache
+   pool::instance().deallocate(first);
+
+   // blocks freed by another thread flow back through the shared list
+   auto const slabs = pool::instance().slabs();
+   std::vector<void*> blocks(1000);
+   for (int round = 0; round < 5; ++round)
+   {
+      for (auto& b : blocks)
+         b = pool::instance().allocate();
+      parallel::raii::join_thread([&blocks]{
+         for (auto b : blocks)
+            pool::instance().deallocate(b);
+      });
+   }
+   EXPECT_GE(slabs + 1, pool::instance().slabs());
+
+   // a thread_local destroyed after the thread's cache frees straight to the shared list
+   using late_pool = parallel::fixed_size_pool<200>;
+   struct late_free
+   {
+      void* block {nullptr};
+      ~late_free() { late_pool::instance().deallocate(block); }
+   };
+   void* freed = nullptr;
+   parallel::raii::join_thread([&freed]{
+      static thread_local late_free holder;   // constructed before the cache, so destroyed after it
+      holder.block = freed = late_pool::instance().allocate();
+   });
+   EXPECT_EQ(freed, late_pool::instance().allocate());
+
+   parallel::queue<std::string, std::mutex, parallel::pool_allocator<std::string>> q;
+   for (int i = 0; i < 100; ++i)
+      q.push(std::to_string(i));
+   std::string value;
+   EXPECT_TRUE(q.try_pop(value));
+   EXPECT_EQ("0", value);
+
+   std::list<int, parallel::pool_allocator<int>> nodes(100, 7);
+   EXPECT_EQ(700, std::accumulate(nodes.begin(), nodes.end(), 0));
+
+   parallel::monotonic_arena scratch(64);
+   {
+      std::vector<int, parallel::arena_allocator<int>> ids{parallel::arena_allocator<int>(scratch)};
+      for (int i = 0; i < 100; ++i)
+         ids.push_back(i);
+      EXPECT_EQ(4950, std::accumulate(ids.begin(), ids.end(), 0));
+   }
+   EXPECT_LT(1u, scratch.chunks());
+   auto aligned = scratch.allocate(3, 64);
+   EXPECT_EQ(0u, reinterpret_cast<std::uintptr_t>(aligned) % 64);
+   scratch.reset();
+   EXPECT_EQ(1u, scratch.chunks());
+}
+
+TEST(paralel, channel)
+{
+   parallel::channel<int> buffered(2);
+   int value = 0;
+   EXPECT_TRUE(buffered.try_send(1));
+   EXPECT_TRUE(buffered.send(2));
+   EXPECT_FALSE(buffered.try_send(3));
+   EXPECT_TRUE(buffered.recv(value));
+   EXPECT_EQ(1, value);
+   buffered.close();
+   EXPECT_FALSE(buffered.send(4));
+   EXPECT_TRUE(buffered.recv(value));   // drains before failing
+   EXPECT_EQ(2, value);
+   EXPECT_FALSE(buffered.recv(value));
+
+   // unbuffered send waits for the receiver
+   parallel::channel<std::string> unbuffered;
+   std::string text;
+   EXPECT_FALSE(unbuffered.try_send("lost"));
+   std::atomic_bool sent {false};
+   {
+      parallel::raii::join_thread sender([&]{
+         sent = unbuffered.send("hello");
+      });
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      EXPECT_FALSE(sent);
+      EXPECT_TRUE(unbuffered.recv(text));
+   }
+   EXPECT_TRUE(sent);
+   EXPECT_EQ("hello", text);
+
+   // select sleeps on all channels and wakes on the first one ready
+   parallel::channel<int> a;
+   parallel::channel<std::string> b;
+   parallel::channel<int> quit;
+   int from_a = 0;
+   std::string from_b;
+   int ignored;
+   EXPECT_EQ(3u, parallel::try_select(parallel::on_recv(a, from_a), parallel::on_recv(b, from_b),
+                                      parallel::on_recv(quit, ignored)).index);
+   {
+      parallel::raii::join_thread producer([&]{
+         b.send("b");
+         a.send(1);
+         quit.close();
+      });
+
+      std::vector<std::size_t> order;
+      while (true)
+      {
+         auto s = parallel::select(parallel::on_recv(a, from_a), parallel::on_recv(b, from_b),
+                                   parallel::on_recv(quit, ignored));
+         if (s.index == 2)
+         {
+            EXPECT_FALSE(s.ok);
+            break;
+         }
+         EXPECT_TRUE(s.ok);
+         order.push_back(s.index);
+      }
+      EXPECT_EQ((std::vector<std::size_t>{1, 0}), order);
+   }
+   EXPECT_EQ(1, from_a);
+   EXPECT_EQ("b", from_b);
+
+   // send cases, and selects meeting each other on both ends
+   parallel::channel<int> ping;
+   parallel::channel<int> pong;
+   long total = 0;
+   {
+      parallel::raii::join_thread echo([&]{
+         int v;
+         while (ping.recv(v))
+            parallel::select(parallel::on_send(pong, v * 2), parallel::on_recv(ping, v));
+      });
+      for (int i = 1; i <= 1000; ++i)
+      {
+         int reply = 0;
+         auto s = parallel::select(parallel::on_send(ping, i), parallel::on_recv(pong, reply));
+         if (s.index == 1)
+            total += reply;
+      }
+      ping.close();
+   }
+   EXPECT_LT(0, total);
+
+   // a channel that is always ready does not starve the others
+   parallel::channel<int> busy(100);
+   parallel::channel<int> other(100);
+   for (int i = 0; i < 100; ++i)
+   {
+      busy.send(i);
+      other.send(i);
+   }
+   int picked[2] = {0, 0};
+   for (int i = 0; i < 100; ++i)
+      ++picked[parallel::select(parallel::on_recv(busy, value), parallel::on_recv(other, value)).index];
+   EXPECT_EQ(50, picked[0]);
+}
+
+TEST(paralel, concurrent_hash_map)
+{
+   parallel::concurrent_hash_map<int, int> m(16, 2);
+   int value = 0;
+   EXPECT_FALSE(m.find(1, value));
+   EXPECT_TRUE(m.insert(1, 10));
+   EXPECT_FALSE(m.insert(1, 11));
+   EXPECT_TRUE(m.find(1, value));
+   EXPECT_EQ(10, value);
+   EXPECT_FALSE(m.insert_or_assign(1, 12));
+   EXPECT_TRUE(m.update(1, [](int& v){ v += 1; }));
+   EXPECT_TRUE(m.find(1, value));
+   EXPECT_EQ(13, value);
+   EXPECT_FALSE(m.update(2, [](int& v){ v += 1; }));
+
+   // grows the segments and reuses erased slots
+   for (int round = 0; round < 3; ++round)
+   {
+      for (int i = 0; i < 1000; ++i)
+         EXPECT_TRUE(m.insert(100 + i, i));
+      for (int i = 0; i < 1000; ++i)
+         EXPECT_TRUE(m.erase(100 + i));
+   }
+   for (int i = 0; i < 1000; ++i)
+      m.insert(100 + i, i);
+   EXPECT_EQ(1001u, m.size());
+   EXPECT_TRUE(m.find(599, value));
+   EXPECT_EQ(499, value);
+   EXPECT_FALSE(m.erase(2));
+   EXPECT_FALSE(m.contains(2));
+
+   // readers never see a torn value while writers insert, update, erase and resize
+   struct entry { std::uint64_t key; std::uint64_t version; };
+   parallel::concurrent_hash_map<std::uint64_t, entry> shared(8, 4);
+   int const writers_count = 3;
+   std::uint64_t const keys_per_writer = 2000;
+   std::atomic_bool done {false};
+   std::atomic<long> torn {0};
+   {
+      std::vector<parallel::raii::join_thread> readers;
+      for (int r = 0; r < 3; ++r)
+         readers.emplace_back([&]{
+            std::uint64_t k = 0;
+            while (!done)
+            {
+               entry e;
+               if (shared.find(k, e) && e.key != k)
+                  ++torn;
+               k = (k + 7) % (writers_count * keys_per_writer);
+            }
+         });
+
+      std::vector<parallel::raii::join_thread> writers;
+      for (int w = 0; w < writers_count; ++w)
+         writers.emplace_back([&, w]{
+            auto first = w * keys_per_writer;
+            for (auto k = first; k < first + keys_per_writer; ++k)
+               shared.insert(k, entry{k, 0});
+            for (auto k = first; k < first + keys_per_writer; ++k)
+               shared.update(k, [](entry& e){ ++e.version; });
+            for (auto k = first; k < first + keys_per_writer; k += 2)
+               shared.erase(k);
+         });
+      writers.clear();
+      done = true;
+   }
+   EXPECT_EQ(0, torn);
+   EXPECT_EQ(writers_count * keys_per_writer / 2, shared.size());
+   entry e {};
+   EXPECT_TRUE(shared.find(keys_per_writer + 1, e));
+   EXPECT_EQ(1u, e.version);
+   EXPECT_FALSE(shared.contains(keys_per_writer));
+}
+
+TEST(paralel, lru_cache)
+{
+   parallel::lru_cache<int, std::string> cache(2, 1);
+   std::string value;
+   cache.put(1, "one");
+   cache.put(2, "two");
+   EXPECT_TRUE(cache.get(1, value));   // 2 is now the least recently used
+   cache.put(3, "three");
+   EXPECT_FALSE(cache.get(2, value));
+   EXPECT_TRUE(cache.get(3, value));
+   EXPECT_EQ("three", value);
+   EXPECT_TRUE(cache.erase(3));
+   EXPECT_EQ(1u, cache.size());
+
+   auto stats = cache.stats();
+   EXPECT_EQ(2u, stats.hits);
+   EXPECT_EQ(1u, stats.misses);
+   EXPECT_EQ(1u, stats.evictions);
+
+   // capacity by cost
+   parallel::lru_cache<int, std::string> bytes(10, 1, [](int, std::string const& v){ return v.size(); });
+   bytes.put(1, "aaaa");
+   bytes.put(2, "bbbb");
+   bytes.put(3, "cccc");
+   EXPECT_FALSE(bytes.get(1, value));
+   EXPECT_EQ(2u, bytes.size());
+
+   // concurrent misses on one key compute it once
+   parallel::lru_cache<int, int> memo(100, 4);
+   std::atomic<int> calls {0};
+   std::vector<int> results(6);
+   {
+      std::vector<parallel::raii::join_thread> threads;
+      for (auto& result : results)
+         threads.emplace_back([&]{
+            result = memo.get_or_compute(7, [&calls]{
+               ++calls;
+               std::this_thread::sleep_for(std::chrono::milliseconds(20));
+               return 49;
+            });
+         });
+   }
+   EXPECT_EQ(1, calls);
+   EXPECT_EQ(6, std::count(results.begin(), results.end(), 49));
+   stats = memo.stats();
+   EXPECT_EQ(6u, stats.hits + stats.misses + stats.coalesced);
+   EXPECT_EQ(1u, stats.misses);
+
+   EXPECT_THROW(memo.get_or_compute(8, []() -> int { throw std::runtime_error("failed"); }), std::runtime_error);
+   EXPECT_EQ(64, memo.get_or_compute(8, []{ return 64; }));
+}
+
+template <typename WaitStrategy>
+void disruptor_fan_out(std::int64_t events)
+{
+   struct event
+   {
+      std::int64_t value;
+      std::int64_t journaled;
+   };
+
+   parallel::disruptor<event, WaitStrategy> ring(8);
+   auto& journal = ring.add_consumer();
+   auto& replicate = ring.add_consumer();
+   auto& logic = ring.add_consumer({&journal, &replicate});
+
+   std::int64_t journal_sum = 0, replicate_sum = 0, logic_sum = 0;
+   bool in_order = true, after_journal = true;
+   {
+      parallel::raii::join_thread j([&]{
+         while (journal.process([&](event& e, std::int64_t s, bool){
+            in_order = in_order && e.value == s;
+            e.journaled = s;
+            journal_sum += e.value;
+         }))
+            ;
+      });
+      parallel::raii::join_thread r([&]{
+         while (replicate.process([&](event& e, std::int64_t, bool){ replicate_sum += e.value; }))
+            ;
+      });
+      parallel::raii::join_thread l([&]{
+         while (logic.process([&](event& e, std::int64_t s, bool){
+            after_journal = after_journal && e.journaled == s && journal.sequence() >= s;
+            logic_sum += e.value;
+         }))
+            ;
+      });
+
+      for (std::int64_t i = 0; i < events; ++i)
+         ring.publish_event([i](event& e){ e.value = i; e.journaled = -1; });
+
+      // up to a ring of events may still be pending, the consumers drain them
+      ring.halt();
+   }
+
+   auto const expected = events * (events - 1) / 2;
+   EXPECT_EQ(expected, journal_sum);
+   EXPECT_EQ(expected, replicate_sum);
+   EXPECT_EQ(expected, logic_sum);
+   EXPECT_TRUE(in_order);
+   EXPECT_TRUE(after_journal);
+}
+
+TEST(paralel, disruptor)
+{
+   disruptor_fan_out<parallel::blocking_wait>(20000);
+   disruptor_fan_out<parallel::yielding_wait>(20000);
+   disruptor_fan_out<parallel::busy_spin_wait>(200);
+
+   // halted before any consumer runs: the trailing one starts first and must wait for
+   // its upstream to release the events instead of stopping at once
+   parallel::disruptor<std::int64_t> ring(64);
+   auto& first = ring.add_consumer();
+   auto& second = ring.add_consumer({&first});
+   for (std::int64_t i = 0; i < 50; ++i)
+      ring.publish_event([i](std::int64_t& e){ e = i; });
+   ring.halt();
+
+   std::int64_t first_sum = 0, second_sum = 0;
+   {
+      parallel::raii::join_thread s([&]{
+         while (second.process([&second_sum](std::int64_t& e, std::int64_t, bool){ second_sum += e; }))
+            ;
+      });
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      parallel::raii::join_thread f([&]{
+         while (first.process([&first_sum](std::int64_t& e, std::int64_t, bool){ first_sum += e; }))
+            ;
+      });
+   }
+   EXPECT_EQ(50 * 49 / 2, first_sum);
+   EXPECT_EQ(50 * 49 / 2, second_sum);
+   EXPECT_EQ(49, second.sequence());
+}
+
+TEST(paralel, lock_free_stack)
+{
+   struct node : parallel::stack_hook
+   {
+      int value;
+      std::atomic_bool taken {false};
+   };
+   using stack = parallel::lock_free_stack<node>;
+
+   std::vector<node> nodes(64);
+   for (std::size_t i = 0; i < nodes.size(); ++i)
+      nodes[i].value = static_cast<int>(i);
+
+   stack s;
+   EXPECT_EQ(nullptr, s.pop());
+   s.push(&nodes[0]);
+   stack::link(&nodes[3], &nodes[2]);
+   stack::link(&nodes[2], &nodes[1]);
+   s.push_chain(&nodes[3], &nodes[1]);
+   EXPECT_EQ(3, s.pop()->value);
+
+   int order = 0;
+   for (auto n = s.pop_all(); n; n = stack::next(n))
+      order = order * 10 + n->value;
+   EXPECT_EQ(210, order);
+   EXPECT_TRUE(s.empty());
+
+   // recycling under contention, a node is never handed to two threads at once
+   for (auto& n : nodes)
+      s.push(&n);
+   std::atomic<int> double_owned {0};
+   {
+      std::vector<parallel::raii::join_thread> threads;
+      for (int t = 0; t < 4; ++t)
+         threads.emplace_back([&]{
+            for (int i = 0; i < 50000; ++i)
+            {
+               auto n = s.pop();
+               if (!n)
+                  continue;
+               if (n->taken.exchange(true))
+                  ++double_owned;
+               n->taken = false;
+               s.push(n);
+            }
+         });
+   }
+   EXPECT_EQ(0, double_owned);
+   std::size_t count = 0;
+   for (auto n = s.pop_all(); n; n = stack::next(n))
+      ++count;
+   EXPECT_EQ(nodes.size(), count);
+}
+
+TEST(paralel, work_stealing_deque)
+{
+   parallel::work_stealing_deque<int> d(2);
+   int value = 0;
+   EXPECT_FALSE(d.pop(value));
+   EXPECT_FALSE(d.steal(value));
+
+   for (int i = 0; i < 10; ++i)
+      d.push(i);   // grows 2 -> 16
+   EXPECT_EQ(10u, d.size());
+   EXPECT_TRUE(d.steal(value));
+   EXPECT_EQ(0, value);
+   EXPECT_TRUE(d.pop(value));
+   EXPECT_EQ(9, value);
+   while (d.pop(value))
+      ;
+   EXPECT_EQ(1, value);
+   EXPECT_TRUE(d.empty());
+
+   // every element is taken exactly once, whoever gets it
+   int const count = 200000;
+   int const thieves_count = 6;
+   parallel::work_stealing_deque<int> shared(8);
+   std::vector<std::atomic<int>> taken(count);
+   for (auto& t : taken)
+      t = 0;
+   std::atomic_bool done {false};
+   {
+      std::vector<parallel::raii::join_thread> thieves;
+      for (int i = 0; i < thieves_count; ++i)
+         thieves.emplace_back([&]{
+            int v;
+            while (!done || !shared.empty())
+               if (shared.steal(v))
+                  ++taken[v];
+         });
+
+      for (int i = 0; i < count; ++i)
+      {
+         shared.push(i);
+         if (i % 3 == 0 && shared.pop(value))
+            ++taken[value];
+      }
+      while (shared.pop(value))
+         ++taken[value];
+      done = true;
+   }
+   EXPECT_EQ(count, std::count(taken.begin(), taken.end(), 1));
+}
+
+TEST(paralel, reactor)
+{
+   int echo[2];
+   ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, echo));
+   int pipe_fd[2];
+   ASSERT_EQ(0, ::pipe2(pipe_fd, O_NONBLOCK));
+
+   std::atomic_int running {0};
+   std::atomic_int overlapped {0};
+   std::atomic_int drained {0};
+   {
+      parallel::thread_pool pool;
+      parallel::reactor r(pool, 2);
+
+      r.add(echo[1], EPOLLIN, [](int fd, std::uint32_t){
+         char buf[64];
+         auto n = ::read(fd, buf, sizeof(buf));
+         if (n > 0)
+         {
+            EXPECT_EQ(n, ::write(fd, buf, n));
+         }
+      });
+
+      r.add(pipe_fd[0], EPOLLIN, [&](int fd, std::uint32_t){
+         if (running++ != 0)
+            ++overlapped;
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+         char c;
+         while (::read(fd, &c, 1) == 1)
+            ++drained;
+         --running;
+      }, parallel::reactor::edge);
+
+      for (char c : std::string("0123456789"))
+      {
+         ASSERT_EQ(1, ::write(pipe_fd[1], &c, 1));
+         std::this_thread::sleep_for(std::chrono::microseconds(200));
+      }
+
+      for (std::string msg : {"ping", "pong"})
+      {
+         ASSERT_EQ(4, ::write(echo[0], msg.data(), msg.size()));
+         std::string reply(4, ' ');
+         std::size_t got = 0;
+         while (got < reply.size())
+         {
+            auto n = ::read(echo[0], &reply[got], reply.size() - got);
+            if (n > 0)
+               got += n;
+            else
+               std::this_thread::yield();
+         }
+         EXPECT_EQ(msg, reply);
+      }
+
+      while (drained != 10)
+         std::this_thread::yield();
+
+      r.remove(echo[1]);
+   }
+
+   EXPECT_EQ(0, overlapped);
+   for (int fd : {echo[0], echo[1], pipe_fd[0], pipe_fd[1]})
+      ::close(fd);
+}
+
+TEST(paralel, shm_ring)
+{
+   struct message
+   {
+      std::int64_t value;
+      pid_t from;
+   };
+   using ring_type = parallel::shm_ring<message>;
+   std::string const name = "/parallel_tst_" + std::to_string(::getpid());
+
+   ring_type::unlink(name);
+   auto ring = ring_type::create(name, 64);
+   EXPECT_EQ(64u, ring.capacity());
+   EXPECT_THROW(ring_type::create(name, 64), std::system_error);
+   EXPECT_THROW((parallel::shm_ring<int>::open(name)), std::runtime_error);
+
+   // two producer processes, each opens the segment by name and maps it elsewhere
+   int const per_child = 20000;
+   std::vector<pid_t> children;
+   for (int c = 0; c < 2; ++c)
+   {
+      auto pid = ::fork();
+      if (pid == 0)
+      {
+         int status = 0;
+         {
+            auto producer = ring_type::open(name);
+            producer.attach_producer();
+            for (int i = 1; i <= per_child; ++i)
+               producer.push(message{i, ::getpid()});
+         }
+         ::_exit(status);
+      }
+      children.push_back(pid);
+   }
+
+   std::map<pid_t, std::int64_t> last;
+   std::int64_t sum = 0;
+   bool in_order = true;
+   message m;
+   for (int i = 0; i < 2 * per_child; ++i)
+   {
+      ASSERT_EQ(parallel::shm_status::ok, ring.pop_for(m, std::chrono::seconds(10)));
+      in_order = in_order && m.value == last[m.from] + 1;
+      last[m.from] = m.value;
+      sum += m.value;
+   }
+   for (auto pid : children)
+   {
+      int status;
+      ::waitpid(pid, &status, 0);
+      EXPECT_TRUE(WIFEXITED(status));
+   }
+   EXPECT_TRUE(in_order);
+   EXPECT_EQ(2 * std::int64_t{per_child} * (per_child + 1) / 2, sum);
+   EXPECT_TRUE(ring.dead_producers().empty());   // detached on a clean exit
+   EXPECT_EQ(parallel::shm_status::timeout, ring.pop_for(m, std::chrono::milliseconds(1)));
+
+   // a producer that dies without detaching is reported once to a waiting consumer,
+   // before its parent reaps it too
+   auto crashed = ::fork();
+   if (crashed == 0)
+   {
+      auto producer = ring_type::open(name);
+      producer.attach_producer();
+      producer.push(message{1, ::getpid()});
+      ::_exit(0);   // skips the destructor like a crash would
+   }
+   EXPECT_EQ(parallel::shm_status::ok, ring.pop(m));
+   EXPECT_EQ(parallel::shm_status::producer_dead, ring.pop(m));
+   EXPECT_EQ(std::vector<pid_t>{crashed}, ring.dead());
+   EXPECT_TRUE(ring.dead_producers().empty());
+   EXPECT_EQ(parallel::shm_status::timeout, ring.pop_for(m, std::chrono::milliseconds(1)));
+   ::waitpid(crashed, nullptr, 0);
+
+   // the consumer then keeps serving the producers that are alive
+   auto late = ::fork();
+   if (late == 0)
+   {
+      {
+         auto producer = ring_type::open(name);
+         producer.attach_producer();
+         std::this_thread::sleep_for(std::chrono::milliseconds(20));
+         producer.push(message{2, ::getpid()});
+      }
+      ::_exit(0);
+   }
+   EXPECT_EQ(parallel::shm_status::ok, ring.pop(m));
+   EXPECT_EQ(2, m.value);
+   ::waitpid(late, nullptr, 0);
+
+   ring_type::unlink(name);
+}
+
+TEST(paralel, async_logger)
+{
+   char path[] = "/tmp/parallel-log-test-XXXXXX";
+   auto fd = ::mkstemp(path);
+   ASSERT_LE(0, fd);
+   ::close(fd);
+
+   auto read_lines = [&path]{
+      std::ifstream in(path);
+      std::vector<std::string> lines;
+      for (std::string line; std::getline(in, line); )
+         lines.push_back(line);
+      return lines;
+   };
+
+   int const threads = 4;
+   int const count = 1000;
+   std::string const long_line(1000, 'x');
+   {
+      parallel::async_logger log(path);
+      std::vector<parallel::raii::join_thread> producers;
+      for (int t = 0; t < threads; ++t)
+         producers.emplace_back([&log, t]{
+            for (int i = 0; i < count; ++i)
+               log.logf("%d %d", t, i);
+         });
+      producers.clear();
+      EXPECT_TRUE(log.write(long_line));
+
+      log.flush();
+      EXPECT_EQ(std::uint64_t(threads * count + 1), log.written());
+      EXPECT_EQ(std::size_t(threads * count + 1), read_lines().size());
+   }
+
+   // every line written once, each thread's lines in order
+   auto lines = read_lines();
+   ASSERT_EQ(std::size_t(threads * count + 1), lines.size());
+   EXPECT_EQ(long_line, lines.back());
+   std::vector<int> next(threads, 0);
+   for (std::size_t i = 0; i + 1 < lines.size(); ++i)
+   {
+      int t = -1, n = -1;
+      std::istringstream(lines[i]) >> t >> n;
+      ASSERT_TRUE(t >= 0 && t < threads);
+      ASSERT_EQ(next[t]++, n);
+   }
+
+   // the writer sleeps for the whole test, so the queue stays full
+   parallel::async_logger_options options;
+   options.capacity = 1;
+   options.flush_interval = std::chrono::seconds(60);
+   options.batch_bytes = 1 << 20;
+   options.overflow = parallel::overflow_policy::drop;
+   {
+      parallel::async_logger log(path, options);
+      EXPECT_TRUE(log.write("kept"));
+      EXPECT_FALSE(log.write("dropped"));
+      EXPECT_EQ(1u, log.dropped());
+   }
+   EXPECT_EQ("kept", read_lines().back());
+
+   std::size_t failed_line_test = 0;
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)   // sanitizers abort on huge allocations
+   // a line that cannot be allocated gives its place in the queue back
+   failed_line_test = 1;
+   {
+      parallel::async_logger log(path, options);
+      EXPECT_THROW(log.write("x", std::numeric_limits<std::size_t>::max() - 1), std::bad_alloc);
+      EXPECT_TRUE(log.write("after a failed line"));
+   }
+   EXPECT_EQ("after a failed line", read_lines().back());
+#endif
+
+   options.overflow = parallel::overflow_policy::count;
+   {
+      parallel::async_logger log(path, options);
+      log.write("kept");
+      log.write("dropped");
+      log.write("dropped");
+   }
+   lines = read_lines();
+   EXPECT_EQ("kept", lines[lines.size() - 2]);
+   EXPECT_EQ("parallel::async_logger: 2 records dropped", lines.back());
+
+   // blocked producers wake the writer instead of waiting for the interval
+   options.capacity = 2;
+   options.overflow = parallel::overflow_policy::block;
+   {
+      parallel::async_logger log(path, options);
+      std::vector<parallel::raii::join_thread> producers;
+      for (int t = 0; t < threads; ++t)
+         producers.emplace_back([&log]{
+            for (int i = 0; i < 200; ++i)
+               EXPECT_TRUE(log.logf("blocking %d", i));
+         });
+      producers.clear();
+      EXPECT_EQ(0u, log.dropped());
+   }
+   EXPECT_EQ(std::size_t(threads * count + 1 + 1 + failed_line_test + 2 + threads * 200), read_lines().size());
+
+   EXPECT_THROW(parallel::async_logger("/nonexistent/dir/log"), std::system_error);
+   ::unlink(path);
+}
+
+#if defined(__cpp_impl_coroutine)
+TEST(paralel, coroutine)
+{
+   parallel::queue<int> requests;
+   parallel::thread_pool pool;
+   auto const caller = std::this_thread::get_id();
+
+   auto handler = [&]() -> parallel::task<int> {
+      co_await pool.schedule();
+      EXPECT_NE(caller, std::this_thread::get_id());
+
+      int request = co_await parallel::async_pop(requests);
+      int doubled = co_await parallel::async(pool, [request]{ return request * 2; });
+      co_return doubled + 1;
+   };
+
+   auto nested = [&]() -> parallel::task<int> {
+      co_return co_await handler();
+   };
+
+   std::thread producer([&requests]{
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      requests.push(20);
+   });
+
+   EXPECT_EQ(41, parallel::sync_wait(nested()));
+   producer.join();
+
+   auto failing = [&]() -> parallel::task<> {
+      co_await parallel::async(pool, []{ throw std::runtime_error("failed"); });
+   };
+   EXPECT_THROW(parallel::sync_wait(failing()), std::runtime_error);
+
+   auto drained = [&]() -> parallel::task<int> {
+      co_return co_await parallel::async_pop(requests);
+   };
+   std::thread closer([&requests]{
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      requests.close();
+   });
+   EXPECT_THROW(parallel::sync_wait(drained()), parallel::queue_closed);
+   closer.join();
+}
+#endif
+
 /**
 TEST(paralel, sequence)
 {
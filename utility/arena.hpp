@@ -0,0 +1,161 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ * Example
+ *
+ * pool.submit([]{
+ *    parallel::monotonic_arena scratch;
+ *    std::vector<int, parallel::arena_allocator<int>> ids(parallel::arena_allocator<int>(scratch));
+ *    ...                    // no frees until scratch goes out of scope
+ * });
+ */
+
+namespace parallel {
+
+/**
+ * @brief The monotonic_arena class
+ * Bump allocator for short-lived scratch memory: deallocation is a no-op and
+ * everything is freed at once by release() or the destructor. Chunks double in size,
+ * reset() keeps the largest one for the next round. Not thread-safe, one per task.
+ */
+class monotonic_arena
+{
+   struct chunk_deleter
+   {
+      void operator()(char* p) const noexcept { ::operator delete(p); }
+   };
+
+   using tChunk = std::unique_ptr<char, chunk_deleter>;
+
+   std::vector<tChunk> _chunks;
+   std::size_t _next_size;
+   std::size_t _last_size {0};
+   char* _pos {nullptr};
+   char* _end {nullptr};
+
+   void add_chunk(std::size_t min_size)
+   {
+      auto size = std::max(_next_size, min_size);
+      _chunks.emplace_back(static_cast<char*>(::operator new(size)));
+      _pos = _chunks.back().get();
+      _end = _pos + size;
+      _last_size = size;
+      _next_size = size * 2;
+   }
+
+public:
+   explicit monotonic_arena(std::size_t initial_size = 4096)
+   : _next_size(std::max<std::size_t>(initial_size, 64))
+   {   }
+
+   monotonic_arena(monotonic_arena const&) = delete;
+   monotonic_arena& operator=(monotonic_arena const&) = delete;
+
+   void* allocate(std::size_t bytes, std::size_t alignment = alignof(std::max_align_t))
+   {
+      auto fits = [this, alignment, bytes](char*& p){
+         auto address = reinterpret_cast<std::uintptr_t>(_pos);
+         auto padding = (alignment - address % alignment) % alignment;
+         if (!_pos || static_cast<std::size_t>(_end - _pos) < padding + bytes)
+            return false;
+         p = _pos + padding;
+         return true;
+      };
+
+      char* p = nullptr;
+      if (!fits(p))
+      {
+         add_chunk(bytes + alignment);
+         fits(p);
+      }
+
+      _pos = p + bytes;
+      return p;
+   }
+
+   // keeps the last (largest) chunk
+   void reset() noexcept
+   {
+      if (_chunks.empty())
+         return;
+
+      std::swap(_chunks.front(), _chunks.back());
+      _chunks.resize(1);
+      _pos = _chunks.front().get();
+      _end = _pos + _last_size;
+   }
+
+   void release() noexcept
+   {
+      _chunks.clear();
+      _pos = _end = nullptr;
+   }
+
+   std::size_t chunks() const noexcept { return _chunks.size(); }
+};
+
+template <typename T>
+class arena_allocator
+{
+   template <typename U> friend class arena_allocator;
+
+   monotonic_arena* _arena;
+
+public:
+   using value_type = T;
+
+   explicit arena_allocator(monotonic_arena& arena) noexcept : _arena(&arena)
+   {   }
+
+   template <typename U>
+   arena_allocator(arena_allocator<U> const& other) noexcept : _arena(other._arena)
+   {   }
+
+   T* allocate(std::size_t n)
+   {
+      return static_cast<T*>(_arena->allocate(n * sizeof(T), alignof(T)));
+   }
+
+   void deallocate(T*, std::size_t) noexcept
+   {   }
+
+   template <typename U>
+   bool operator==(arena_allocator<U> const& other) const noexcept { return _arena == other._arena; }
+
+   template <typename U>
+   bool operator!=(arena_allocator<U> const& other) const noexcept { return _arena != other._arena; }
+};
+
+}
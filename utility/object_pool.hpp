@@ -0,0 +1,319 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include "sync/spin_lock.hpp"
+
+/**
+ * Example
+ *
+ * void* p = parallel::fixed_size_pool<sizeof(order)>::instance().allocate();
+ * auto o = new (p) order{...};
+ * o->~order();
+ * parallel::fixed_size_pool<sizeof(order)>::instance().deallocate(p);
+ *
+ * std::list<order, parallel::pool_allocator<order>> book;
+ * parallel::queue<tTask, std::mutex, parallel::pool_allocator<tTask>> tasks;
+ */
+
+namespace parallel {
+
+/**
+ * @brief The fixed_size_pool class
+ * Process-wide pool of BlockSize blocks (rounded up to 16 bytes). Each thread keeps a
+ * free list of its own and trades whole batches of blocks with the shared list, so a
+ * thread takes the shared lock at most once per batch_size allocations or frees.
+ * Blocks come from slabs that are never returned to the system; a thread's free list
+ * goes back to the shared list when the thread exits.
+ */
+template <std::size_t BlockSize>
+class fixed_size_pool
+{
+public:
+   static constexpr std::size_t block_size = (BlockSize + 15) / 16 * 16;
+   static constexpr std::size_t batch_size = 32;
+
+private:
+   static constexpr std::size_t batch_bytes = block_size * batch_size;
+   // about 64 KiB, a whole number of batches
+   static constexpr std::size_t slab_size = (64 * 1024 + batch_bytes - 1) / batch_bytes * batch_bytes;
+
+   struct block
+   {
+      block* next;
+   };
+
+   struct chain
+   {
+      block* head;
+      std::size_t count;
+   };
+
+   // Trivially destructible, so it stays usable from thread_local destructors that run
+   // after the flush; those find it torn down and go to the shared list.
+   struct thread_cache
+   {
+      block* head;
+      std::size_t count;
+      bool torn_down;
+   };
+
+   struct cache_flush
+   {
+      thread_cache& cache;
+
+      ~cache_flush()
+      {
+         if (cache.head)
+            instance().put_chain({cache.head, cache.count});
+         cache = {nullptr, 0, true};
+      }
+   };
+
+   spin_lock _mut;
+   std::vector<chain> _chains;
+   char* _slab {nullptr};
+   char* _slab_end {nullptr};
+   std::atomic<std::size_t> _slabs {0};
+
+   fixed_size_pool() = default;
+
+   static thread_cache& local()
+   {
+      static thread_local thread_cache cache {nullptr, 0, false};
+      static thread_local cache_flush flush {cache};
+      return flush.cache;
+   }
+
+   void put_chain(chain c)
+   {
+      std::lock_guard<spin_lock> lk(_mut);
+      _chains.push_back(c);
+   }
+
+   chain take_chain()
+   {
+      std::lock_guard<spin_lock> lk(_mut);
+      if (!_chains.empty())
+      {
+         auto c = _chains.back();
+         _chains.pop_back();
+         return c;
+      }
+
+      if (_slab == _slab_end)
+      {
+         _slab = static_cast<char*>(::operator new(slab_size));
+         _slab_end = _slab + slab_size;
+         _slabs.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      // carve a batch
+      chain c {nullptr, batch_size};
+      for (std::size_t i = 0; i < batch_size; ++i, _slab += block_size)
+         c.head = new (_slab) block{c.head};
+      return c;
+   }
+
+public:
+   fixed_size_pool(fixed_size_pool const&) = delete;
+   fixed_size_pool& operator=(fixed_size_pool const&) = delete;
+
+   // never destroyed, thread caches may flush into it during static destruction
+   static fixed_size_pool& instance()
+   {
+      static auto pool = new fixed_size_pool;
+      return *pool;
+   }
+
+   void* allocate()
+   {
+      auto& cache = local();
+      if (cache.torn_down)
+      {
+         auto c = take_chain();
+         auto b = c.head;
+         if (b->next)
+            put_chain({b->next, c.count - 1});
+         return b;
+      }
+
+      if (!cache.head)
+      {
+         auto c = take_chain();
+         cache.head = c.head;
+         cache.count = c.count;
+      }
+
+      auto b = cache.head;
+      cache.head = b->next;
+      --cache.count;
+      return b;
+   }
+
+   void deallocate(void* p) noexcept
+   {
+      auto& cache = local();
+      if (cache.torn_down)
+      {
+         try
+         {
+            put_chain({new (p) block{nullptr}, 1});
+         }
+         catch (...)
+         {
+            // no memory for the shared list, the block is lost
+         }
+         return;
+      }
+
+      cache.head = new (p) block{cache.head};
+      if (++cache.count < 2 * batch_size)
+         return;
+
+      // keep one batch, hand the other one back
+      auto last = cache.head;
+      for (std::size_t i = 1; i < batch_size; ++i)
+         last = last->next;
+
+      chain c {cache.head, batch_size};
+      cache.head = last->next;
+      cache.count -= batch_size;
+      last->next = nullptr;
+      try
+      {
+         put_chain(c);
+      }
+      catch (...)
+      {
+         last->next = cache.head;   // no memory for the shared list, keep the blocks
+         cache.head = c.head;
+         cache.count += batch_size;
+      }
+   }
+
+   // slabs taken from operator new so far
+   std::size_t slabs() const noexcept
+   {
+      return _slabs.load(std::memory_order_relaxed);
+   }
+};
+
+template <std::size_t BlockSize>
+constexpr std::size_t fixed_size_pool<BlockSize>::block_size;
+
+template <std::size_t BlockSize>
+constexpr std::size_t fixed_size_pool<BlockSize>::batch_size;
+
+namespace detail {
+
+constexpr std::size_t pooled_limit = 1024;
+constexpr std::size_t size_classes = pooled_limit / 16;
+
+template <std::size_t Size>
+void* allocate_block()
+{
+   return fixed_size_pool<Size>::instance().allocate();
+}
+
+template <std::size_t Size>
+void deallocate_block(void* p) noexcept
+{
+   fixed_size_pool<Size>::instance().deallocate(p);
+}
+
+// dispatch a runtime size class to its pool
+template <std::size_t... Class>
+void* pool_allocate(std::size_t size_class, std::index_sequence<Class...>)
+{
+   static void* (* const table[])() = { &allocate_block<(Class + 1) * 16>... };
+   return table[size_class]();
+}
+
+template <std::size_t... Class>
+void pool_deallocate(std::size_t size_class, void* p, std::index_sequence<Class...>) noexcept
+{
+   static void (* const table[])(void*) = { &deallocate_block<(Class + 1) * 16>... };
+   table[size_class](p);
+}
+
+}
+
+/**
+ * @brief The pool_allocator class
+ * Stateless allocator over the fixed_size_pool of the request's 16 byte size class,
+ * for requests up to 1 KiB (list and map nodes, deque blocks). Larger or over-aligned
+ * requests go to operator new.
+ */
+template <typename T>
+class pool_allocator
+{
+   static constexpr bool pooled(std::size_t n) noexcept
+   {
+      return alignof(T) <= 16 && n != 0 && n <= detail::pooled_limit / sizeof(T);
+   }
+
+public:
+   using value_type = T;
+
+   pool_allocator() noexcept = default;
+
+   template <typename U>
+   pool_allocator(pool_allocator<U> const&) noexcept
+   {   }
+
+   T* allocate(std::size_t n)
+   {
+      if (!pooled(n))
+         return static_cast<T*>(::operator new(n * sizeof(T)));
+
+      auto size_class = (n * sizeof(T) - 1) / 16;
+      return static_cast<T*>(detail::pool_allocate(size_class, std::make_index_sequence<detail::size_classes>{}));
+   }
+
+   void deallocate(T* p, std::size_t n) noexcept
+   {
+      if (!pooled(n))
+         return ::operator delete(p);
+
+      auto size_class = (n * sizeof(T) - 1) / 16;
+      detail::pool_deallocate(size_class, p, std::make_index_sequence<detail::size_classes>{});
+   }
+
+   template <typename U>
+   bool operator==(pool_allocator<U> const&) const noexcept { return true; }
+
+   template <typename U>
+   bool operator!=(pool_allocator<U> const&) const noexcept { return false; }
+};
+
+}
@@ -79,8 +79,19 @@ public :
       clear();
    }
 
+   property( property const& rhs )
+   :  _valid( false )
+   {
+      if ( rhs.is_valid() )
+      {
+          new ( &_storage._value ) T ( rhs.value() );
+         _valid = true;
+      }
+   }
+
    template <typename OA>
    property( property<T, OA> const& rhs)
+   :  _valid( false )
    {
       if ( rhs.is_valid() )
       {
@@ -91,6 +102,7 @@ public :
 
    template <typename OA>
    property( property<T, OA>&& rhs)
+   :  _valid( false )
    {
       if ( rhs.is_valid() )
       {
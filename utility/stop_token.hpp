@@ -0,0 +1,163 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+/**
+ * Cooperative cancellation for C++14, modelled on std::stop_source / std::stop_token.
+ *
+ * Example
+ *
+ * raii::join_thread consumer([&q](parallel::stop_token token){
+ *    int item;
+ *    while (q.wait_and_pop(item, token))   // sleeps until data, close() or stop
+ *       handle(item);
+ * });
+ * // ~join_thread requests the stop and joins
+ */
+
+namespace parallel {
+
+namespace detail {
+
+struct stop_state
+{
+   std::atomic_bool requested {false};
+   std::mutex mut;
+   std::list<std::function<void()>> callbacks;
+};
+
+}
+
+class stop_token
+{
+   friend class stop_source;
+   friend class stop_callback;
+
+   std::shared_ptr<detail::stop_state> _state;
+
+   explicit stop_token(std::shared_ptr<detail::stop_state> state) noexcept
+   : _state(std::move(state))
+   {   }
+
+public:
+   stop_token() noexcept = default;
+
+   bool stop_requested() const noexcept
+   {
+      return _state && _state->requested.load(std::memory_order_acquire);
+   }
+
+   bool stop_possible() const noexcept
+   {
+      return static_cast<bool>(_state);
+   }
+};
+
+class stop_source
+{
+   std::shared_ptr<detail::stop_state> _state;
+
+public:
+   stop_source() : _state(std::make_shared<detail::stop_state>())
+   {   }
+
+   stop_token get_token() const noexcept
+   {
+      return stop_token(_state);
+   }
+
+   bool stop_requested() const noexcept
+   {
+      return _state && _state->requested.load(std::memory_order_acquire);
+   }
+
+   // Runs the registered callbacks on the calling thread; returns false if a stop
+   // was requested before.
+   bool request_stop()
+   {
+      if (!_state || _state->requested.exchange(true, std::memory_order_acq_rel))
+         return false;
+
+      std::lock_guard<std::mutex> lk(_state->mut);
+      for (auto& callback : _state->callbacks)
+         callback();
+      return true;
+   }
+};
+
+/**
+ * @brief The stop_callback class
+ * Registers a callback for the lifetime of the object. It runs on the thread requesting
+ * the stop, or right away in the constructor if the stop was already requested.
+ * The destructor waits for a callback that is running on another thread.
+ */
+class stop_callback
+{
+   std::shared_ptr<detail::stop_state> _state;
+   std::list<std::function<void()>>::iterator _it;
+   bool _registered {false};
+
+public:
+   template <typename F>
+   stop_callback(stop_token const& token, F&& f)
+   : _state(token._state)
+   {
+      if (!_state)
+         return;
+
+      std::unique_lock<std::mutex> lk(_state->mut);
+      if (_state->requested.load(std::memory_order_acquire))
+      {
+         lk.unlock();
+         f();
+         return;
+      }
+
+      _it = _state->callbacks.emplace(_state->callbacks.end(), std::forward<F>(f));
+      _registered = true;
+   }
+
+   ~stop_callback()
+   {
+      if (!_registered)
+         return;
+
+      std::lock_guard<std::mutex> lk(_state->mut);
+      _state->callbacks.erase(_it);
+   }
+
+   stop_callback(stop_callback const&) = delete;
+   stop_callback& operator=(stop_callback const&) = delete;
+};
+
+}
@@ -0,0 +1,174 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+/**
+ * Example
+ *
+ * parallel::enumerable_thread_specific<std::vector<hit>> hits;
+ * pool.submit([&]{ hits.local().push_back(h); });   // no sharing between workers
+ * ...
+ * hits.for_each([&](std::vector<hit>& v){ all.insert(all.end(), v.begin(), v.end()); });
+ */
+
+namespace parallel {
+
+namespace detail {
+
+// Dense process-wide number of the calling thread, never reused.
+inline std::size_t thread_ordinal() noexcept
+{
+   static std::atomic<std::size_t> next {0};
+   static thread_local std::size_t const ordinal = next.fetch_add(1, std::memory_order_relaxed);
+   return ordinal;
+}
+
+}
+
+/**
+ * @brief The enumerable_thread_specific class
+ * A T per thread, created on the thread's first local() call, plus enumeration of all
+ * of them. Values are found by thread ordinal in a table of doubling segments, so
+ * local() is a few loads and never locks after the first call. Values of exited
+ * threads are kept and enumerated until destruction.
+ * for_each() may run while threads create their values; synchronizing access to the
+ * values themselves is up to the caller.
+ */
+template <typename T>
+class enumerable_thread_specific
+{
+   static constexpr std::size_t first_segment = 64;
+   static constexpr std::size_t segments_count = 32;
+
+   using tSlot = std::atomic<T*>;
+
+   std::function<T()> _init;
+   std::mutex _grow;
+   std::array<std::atomic<tSlot*>, segments_count> _segments {};
+
+   // segment i holds the ordinals [64 * (2^i - 1), 64 * (2^(i + 1) - 1))
+   static std::size_t segment_of(std::size_t ordinal) noexcept
+   {
+      std::size_t i = 0;
+      for (auto n = ordinal / first_segment + 1; n > 1; n >>= 1)
+         ++i;
+      return i;
+   }
+
+   static std::size_t segment_size(std::size_t segment) noexcept
+   {
+      return first_segment << segment;
+   }
+
+   static std::size_t segment_start(std::size_t segment) noexcept
+   {
+      return first_segment * ((std::size_t{1} << segment) - 1);
+   }
+
+   tSlot& slot(std::size_t ordinal)
+   {
+      auto i = segment_of(ordinal);
+      auto segment = _segments[i].load(std::memory_order_acquire);
+      if (!segment)
+      {
+         std::lock_guard<std::mutex> lk(_grow);
+         segment = _segments[i].load(std::memory_order_relaxed);
+         if (!segment)
+         {
+            segment = new tSlot[segment_size(i)]();
+            _segments[i].store(segment, std::memory_order_release);
+         }
+      }
+      return segment[ordinal - segment_start(i)];
+   }
+
+public:
+   explicit enumerable_thread_specific(std::function<T()> init = []{ return T(); })
+   : _init(std::move(init))
+   {   }
+
+   enumerable_thread_specific(enumerable_thread_specific const&) = delete;
+   enumerable_thread_specific& operator=(enumerable_thread_specific const&) = delete;
+
+   ~enumerable_thread_specific()
+   {
+      for (std::size_t i = 0; i < segments_count; ++i)
+      {
+         auto segment = _segments[i].load(std::memory_order_relaxed);
+         if (!segment)
+            continue;
+
+         for (std::size_t j = 0; j < segment_size(i); ++j)
+            delete segment[j].load(std::memory_order_relaxed);
+         delete[] segment;
+      }
+   }
+
+   T& local()
+   {
+      auto& s = slot(detail::thread_ordinal());
+      auto value = s.load(std::memory_order_relaxed);   // only this thread stores it
+      if (!value)
+      {
+         value = new T(_init());
+         s.store(value, std::memory_order_release);
+      }
+      return *value;
+   }
+
+   template <typename F>
+   void for_each(F&& f) const
+   {
+      for (std::size_t i = 0; i < segments_count; ++i)
+      {
+         auto segment = _segments[i].load(std::memory_order_acquire);
+         if (!segment)
+            continue;
+
+         for (std::size_t j = 0; j < segment_size(i); ++j)
+            if (auto value = segment[j].load(std::memory_order_acquire))
+               f(*value);
+      }
+   }
+
+   // threads with a value so far
+   std::size_t size() const
+   {
+      std::size_t count = 0;
+      for_each([&count](T&){ ++count; });
+      return count;
+   }
+};
+
+}
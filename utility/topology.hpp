@@ -0,0 +1,250 @@
+/*
+* Copyright (c) 2018 Artem Komyshan
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/*
+* Author: Artem Komyshan
+*/
+
+#pragma once
+
+#include <sched.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Example
+ *
+ * auto const& topo = parallel::topology::system();
+ *
+ * for (auto cpu : topo.one_per_core())        // no two workers on SMT siblings
+ * {
+ *    raii::thread_attributes attr;
+ *    attr.cpus = {cpu};
+ *    workers.emplace_back(attr, work);
+ * }
+ *
+ * auto neighbours = topo.sharing_cache(cpu, 3); // cpus behind the same L3
+ */
+
+namespace parallel {
+
+struct cpu_info
+{
+   int id;
+   int core;      // physical core id, unique over packages
+   int package;
+   int node;      // NUMA node, 0 if the kernel has no node information
+   int l2;        // lowest cpu sharing the L2, -1 if unknown
+   int l3;        // lowest cpu sharing the L3, -1 if unknown
+};
+
+/**
+ * @brief The topology class
+ * CPU, cache and NUMA layout read from sysfs (/sys/devices/system/cpu and
+ * /sys/devices/system/node), limited to the online cpus the process may run on.
+ * system() parses the live tree once and caches it; load() parses any tree, which
+ * is what the tests do with the fixtures under test/fixtures.
+ */
+class topology
+{
+   std::vector<cpu_info> _cpus;
+
+   static std::string read_line(std::string const& path)
+   {
+      std::ifstream in(path);
+      std::string line;
+      std::getline(in, line);
+      return line;
+   }
+
+   static int read_int(std::string const& path, int fallback)
+   {
+      std::istringstream in(read_line(path));
+      int value;
+      return in >> value ? value : fallback;
+   }
+
+   static int lowest(std::vector<int> const& cpus, int fallback)
+   {
+      return cpus.empty() ? fallback : *std::min_element(cpus.begin(), cpus.end());
+   }
+
+   static int cache_id(std::string const& cpu_dir, int level)
+   {
+      for (int index = 0; ; ++index)
+      {
+         auto const dir = cpu_dir + "/cache/index" + std::to_string(index);
+         auto const found = read_int(dir + "/level", -1);
+         if (found < 0)
+            return -1;
+
+         auto const type = read_line(dir + "/type");
+         if (found == level && type != "Instruction")
+            return lowest(parse_cpulist(read_line(dir + "/shared_cpu_list")), -1);
+      }
+   }
+
+   template <typename Pred>
+   std::vector<int> select(Pred pred) const
+   {
+      std::vector<int> ids;
+      for (auto const& c : _cpus)
+      {
+         if (pred(c))
+            ids.push_back(c.id);
+      }
+      return ids;
+   }
+
+public:
+   // "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+   static std::vector<int> parse_cpulist(std::string const& list)
+   {
+      std::vector<int> cpus;
+      std::istringstream in(list);
+      std::string range;
+      while (std::getline(in, range, ','))
+      {
+         int first = 0;
+         int last = 0;
+         char dash = 0;
+         std::istringstream r(range);
+         if (!(r >> first))
+            continue;
+         if (!(r >> dash >> last) || dash != '-')
+            last = first;
+         for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+      }
+      return cpus;
+   }
+
+   /**
+    * sysfs_root is the directory holding devices/system/{cpu,node}, allowed the cpus the
+    * caller may use (empty means all online cpus).
+    */
+   static topology load(std::string const& sysfs_root, std::vector<int> const& allowed = {})
+   {
+      auto const cpu_root = sysfs_root + "/devices/system/cpu";
+      auto const node_root = sysfs_root + "/devices/system/node";
+
+      std::map<int, int> nodes;
+      for (auto node : parse_cpulist(read_line(node_root + "/online")))
+      {
+         for (auto cpu : parse_cpulist(read_line(node_root + "/node" + std::to_string(node) + "/cpulist")))
+            nodes[cpu] = node;
+      }
+
+      std::set<int> const permitted(allowed.begin(), allowed.end());
+      std::map<std::pair<int, int>, int> cores;
+
+      topology t;
+      for (auto cpu : parse_cpulist(read_line(cpu_root + "/online")))
+      {
+         if (!permitted.empty() && !permitted.count(cpu))
+            continue;
+
+         auto const dir = cpu_root + "/cpu" + std::to_string(cpu);
+         auto const package = read_int(dir + "/topology/physical_package_id", 0);
+         auto const core_id = read_int(dir + "/topology/core_id", cpu);
+         auto const core = cores.emplace(std::make_pair(package, core_id), static_cast<int>(cores.size())).first->second;
+         auto const node = nodes.count(cpu) ? nodes[cpu] : 0;
+
+         t._cpus.push_back(cpu_info{cpu, core, package, node, cache_id(dir, 2), cache_id(dir, 3)});
+      }
+      return t;
+   }
+
+   // the live tree, limited to the affinity mask of the process at the first call
+   static topology const& system()
+   {
+      static topology const cached = []{
+         std::vector<int> allowed;
+         cpu_set_t set;
+         if (::sched_getaffinity(0, sizeof(set), &set) == 0)
+         {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            {
+               if (CPU_ISSET(cpu, &set))
+                  allowed.push_back(cpu);
+            }
+         }
+         return load("/sys", allowed);
+      }();
+      return cached;
+   }
+
+   std::vector<cpu_info> const& cpus() const noexcept
+   {
+      return _cpus;
+   }
+
+   cpu_info const* find(int cpu) const noexcept
+   {
+      auto it = std::find_if(_cpus.begin(), _cpus.end(), [cpu](cpu_info const& c){ return c.id == cpu; });
+      return it == _cpus.end() ? nullptr : &*it;
+   }
+
+   // the lowest allowed cpu of every physical core
+   std::vector<int> one_per_core() const
+   {
+      std::set<int> seen;
+      return select([&seen](cpu_info const& c){ return seen.insert(c.core).second; });
+   }
+
+   std::vector<int> siblings(int cpu) const
+   {
+      auto const info = find(cpu);
+      return info ? select([info](cpu_info const& c){ return c.core == info->core; }) : std::vector<int>{};
+   }
+
+   // allowed cpus sharing the level 2 or 3 cache with cpu
+   std::vector<int> sharing_cache(int cpu, int level) const
+   {
+      auto const info = find(cpu);
+      if (!info || (level != 2 && level != 3))
+         return {};
+
+      auto const id = level == 2 ? info->l2 : info->l3;
+      if (id < 0)
+         return {cpu};
+      return select([level, id](cpu_info const& c){ return (level == 2 ? c.l2 : c.l3) == id; });
+   }
+
+   std::vector<int> node_cpus(int node) const
+   {
+      return select([node](cpu_info const& c){ return c.node == node; });
+   }
+
+   std::vector<int> package_cpus(int package) const
+   {
+      return select([package](cpu_info const& c){ return c.package == package; });
+   }
+};
+
+}